@@ -21,6 +21,10 @@
 #endif // CGHOST_STATIC
 #endif // CGHOST_API
 
+#ifndef CGHOST_THREAD_LOCAL
+#define CGHOST_THREAD_LOCAL _Thread_local
+#endif
+
 //---------------------------------------| DECLARATIONS |
 
 // General macros
@@ -55,8 +59,10 @@ CGHOST_API void std_free(void *a, void *ptr);
 #define CGHOST_ALLOCATOR_STACK_SIZE 32
 #endif
 
-CGHOST_API CgAllocator cg_as[CGHOST_ALLOCATOR_STACK_SIZE];
-CGHOST_API size_t cg_as_top;
+// The allocator stack is per thread, every thread starts with an empty stack
+// and has to push its own allocator
+CGHOST_API CGHOST_THREAD_LOCAL CgAllocator cg_as[CGHOST_ALLOCATOR_STACK_SIZE];
+CGHOST_API CGHOST_THREAD_LOCAL size_t cg_as_top;
 
 #define CG_ALLOCATOR_PUSH(allocator) cg_as[cg_as_top++] = (allocator)
 #define CG_ALLOCATOR_POP() --cg_as_top
@@ -419,9 +425,9 @@ CGHOST_API void clargs_print_error(ClargParser *p, FILE *f);
 #endif // __CGHOST_MEMORY_DEBUG
 
 typedef struct ArenaAllocHeader {
-#ifdef __CGHOST_MEMORY_DEBUG
-  void *owner;
   size_t size;
+  void *owner; // the chunk, checked before a pointer is returned or resized
+#ifdef __CGHOST_MEMORY_DEBUG
   const char
       *file; // defaults to NULL, can be set manually or with ARENA_TRACE_PTR
   int line;  // defaults to zero, can be set manually or with ARENA_TRACE_PTR
@@ -438,25 +444,44 @@ typedef struct ArenaAllocHeader {
   char data[]; // flexible array member
 } ArenaAllocHeader;
 
+// Chunks are ARENA_CHUNK_SIZE bytes including this header and are aligned to
+// ARENA_CHUNK_SIZE, so the owner of a pointer is found by masking its address.
+// Oversize chunks are created for a single allocation that does not fit, they
+// are aligned the same way and freed as soon as the allocation is returned.
 typedef struct ArenaChunk {
   struct ArenaChunk *next;
+  struct ArenaChunk *prev;
+  size_t capacity;
   size_t used;
   size_t ref_count;
-  char memory[ARENA_CHUNK_SIZE];
+  char memory[]; // capacity bytes
 } ArenaChunk;
 
+_Static_assert((ARENA_CHUNK_SIZE & (ARENA_CHUNK_SIZE - 1)) == 0,
+               "ARENA_CHUNK_SIZE must be a power of two");
+
+// chunks is the list of chunks in use, its head is the one allocations are
+// bumped from. Regular chunks that become empty are moved to free_chunks.
 typedef struct Arena {
   ArenaChunk *chunks;
+  ArenaChunk *free_chunks;
 } Arena;
 
-CGHOST_API Arena garena;
+// Per thread, a thread should call garena_free before it exits
+CGHOST_API CGHOST_THREAD_LOCAL Arena garena;
 
 // === Declarations ===
 
 CGHOST_API void *arena_alloc(Arena *arena, size_t size);
 CGHOST_API void *arena_calloc(Arena *arena, size_t count, size_t size);
+// Grows or shrinks in place when ptr is the last allocation of its chunk and
+// the chunk has room, copies otherwise
 CGHOST_API void *arena_realloc(Arena *arena, void *old_ptr, size_t old_size,
                                size_t new_size);
+// Number of bytes that can be used at ptr, at least the requested size
+CGHOST_API size_t arena_usable_size(void *ptr);
+// ptr must come from this arena, arena_return and arena_realloc abort when the
+// header of ptr does not name the chunk ptr lies in
 CGHOST_API void arena_return(Arena *arena, void *ptr);
 CGHOST_API void arena_free(Arena *arena);
 CGHOST_API CgAllocator arena_create_allocator(Arena *arena);
@@ -469,8 +494,32 @@ CGHOST_API void *garena_realloc(void *old_ptr, size_t old_size,
 CGHOST_API void garena_return(void *ptr); // soft-free
 CGHOST_API void garena_free(void);
 
+// Allocates from the garena of the calling thread
 CGHOST_API CgAllocator garena_allocator;
 
+// Scratch: bump allocator over a buffer supplied by the caller, for short lived
+// work such as building one query on the stack. Allocations are not freed one
+// by one (except the last one), scratch_reset reuses the whole buffer. When
+// the buffer is exhausted allocations go to fallback, those are freed through
+// it as usual; with a zeroed fallback they fail instead.
+typedef struct Scratch {
+  char *memory;
+  size_t capacity;
+  size_t used;
+  size_t last; // offset of the last allocation, for in place realloc
+  CgAllocator fallback;
+} Scratch;
+
+CGHOST_API void scratch_init(Scratch *s, void *buffer, size_t size,
+                             CgAllocator fallback);
+CGHOST_API void *scratch_alloc(Scratch *s, size_t size);
+CGHOST_API void *scratch_calloc(Scratch *s, size_t count, size_t size);
+CGHOST_API void *scratch_realloc(Scratch *s, void *old_ptr, size_t old_size,
+                                 size_t new_size);
+CGHOST_API void scratch_return(Scratch *s, void *ptr);
+CGHOST_API void scratch_reset(Scratch *s);
+CGHOST_API CgAllocator scratch_create_allocator(Scratch *s);
+
 // === Inline helpers ===
 #define arena_alloc_t(arena, Type) ((Type *)arena_alloc((arena), sizeof(Type)))
 #define arena_alloc_array(arena, Type, count)                                  \
@@ -490,8 +539,8 @@ CGHOST_API CgAllocator garena_allocator;
 #include <stdarg.h>
 
 // Allocator
-CgAllocator cg_as[CGHOST_ALLOCATOR_STACK_SIZE];
-size_t cg_as_top;
+CGHOST_THREAD_LOCAL CgAllocator cg_as[CGHOST_ALLOCATOR_STACK_SIZE];
+CGHOST_THREAD_LOCAL size_t cg_as_top;
 
 // stdallocator
 CgAllocator std_allocator = {
@@ -695,7 +744,8 @@ CGHOST_API void sb_append_sb(StringBuilder *dest, const StringBuilder *src) {
 }
 
 CGHOST_API char *sb_get_cstr(StringBuilder *sb) {
-  if ('\0' != sb->items[sb->count])
+  // the terminator is counted, items[count] may be past the allocation
+  if (0 == sb->count || '\0' != sb->items[sb->count - 1])
     da_push(*sb, '\0');
 
   return sb->items;
@@ -1021,46 +1071,86 @@ CGHOST_API void clargs_print_error(ClargParser *p, FILE *f) {
 }
 
 // Arena
-Arena garena = {0};
+CGHOST_THREAD_LOCAL Arena garena = {0};
+
+#define ARENA_CHUNK_CAPACITY (ARENA_CHUNK_SIZE - sizeof(ArenaChunk))
+#define ARENA_CHUNK_OF(ptr)                                                    \
+  ((ArenaChunk *)((uintptr_t)(ptr) & ~(uintptr_t)(ARENA_CHUNK_SIZE - 1)))
+#define ARENA_CHUNK_IS_OVERSIZE(chunk)                                         \
+  ((chunk)->capacity > ARENA_CHUNK_CAPACITY)
+
+static ArenaChunk *arena_chunk_create(size_t capacity) {
+  size_t size = ALIGN_UP(sizeof(ArenaChunk) + capacity, ARENA_CHUNK_SIZE);
+  ArenaChunk *chunk = (ArenaChunk *)aligned_alloc(ARENA_CHUNK_SIZE, size);
+  if (chunk) {
+    *chunk = (ArenaChunk){.capacity = capacity};
+  }
+  return chunk;
+}
+
+static void arena_chunk_link(ArenaChunk **head, ArenaChunk *chunk) {
+  chunk->prev = NULL;
+  chunk->next = *head;
+  if (*head)
+    (*head)->prev = chunk;
+  *head = chunk;
+}
+
+static void arena_chunk_unlink(ArenaChunk **head, ArenaChunk *chunk) {
+  if (chunk->prev)
+    chunk->prev->next = chunk->next;
+  else
+    *head = chunk->next;
+  if (chunk->next)
+    chunk->next->prev = chunk->prev;
+}
 
-static ArenaChunk *arena_chunk_create(void) {
-  return (ArenaChunk *)calloc(
-      1, sizeof(ArenaChunk)); // calloc zeroes memory and all fields
+// Makes a chunk with room for total_size bytes the head of arena->chunks
+static ArenaChunk *arena_grow(Arena *arena, size_t total_size) {
+  ArenaChunk *chunk = NULL;
+  if (total_size > ARENA_CHUNK_CAPACITY) {
+    chunk = arena_chunk_create(total_size);
+  } else if (arena->free_chunks) {
+    chunk = arena->free_chunks;
+    arena_chunk_unlink(&arena->free_chunks, chunk);
+  } else {
+    chunk = arena_chunk_create(ARENA_CHUNK_CAPACITY);
+  }
+  if (!chunk)
+    return NULL;
+
+  if (ARENA_CHUNK_IS_OVERSIZE(chunk) && arena->chunks) {
+    // keep bumping from the current chunk, this one is full right away
+    arena_chunk_link(&arena->chunks->next, chunk);
+    chunk->prev = arena->chunks;
+  } else {
+    arena_chunk_link(&arena->chunks, chunk);
+  }
+  return chunk;
 }
 
 CGHOST_API void *arena_alloc(Arena *arena, size_t size) {
-  if (size > ARENA_CHUNK_SIZE)
+  if (size > SIZE_MAX / 2)
     return NULL;
 
   size_t total_size =
       ALIGN_UP(sizeof(ArenaAllocHeader) + size, ARENA_ALIGNMENT);
   ArenaChunk *chunk = arena->chunks;
 
-  while (chunk && (ARENA_CHUNK_SIZE - ALIGN_UP(chunk->used, ARENA_ALIGNMENT)) <
-                      total_size) {
-    chunk = chunk->next;
-  }
-
-  if (!chunk) {
-    chunk = arena_chunk_create();
+  // fast path: bump the current chunk
+  if (!chunk || chunk->capacity - chunk->used < total_size) {
+    chunk = arena_grow(arena, total_size);
     if (!chunk)
       return NULL;
-    chunk->next = arena->chunks;
-    arena->chunks = chunk;
   }
 
-  size_t aligned_offset = ALIGN_UP(chunk->used, ARENA_ALIGNMENT);
-  if (aligned_offset + total_size > ARENA_CHUNK_SIZE)
-    return NULL; // Should not happen
-
-  ArenaAllocHeader *header =
-      (ArenaAllocHeader *)(chunk->memory + aligned_offset);
-  chunk->used = aligned_offset + total_size;
+  ArenaAllocHeader *header = (ArenaAllocHeader *)(chunk->memory + chunk->used);
+  chunk->used += total_size;
   chunk->ref_count++;
 
-#ifdef __CGHOST_MEMORY_DEBUG
-  header->owner = chunk;
   header->size = size;
+  header->owner = chunk;
+#ifdef __CGHOST_MEMORY_DEBUG
   header->file = NULL;
   header->line = 0;
   header->tag = ARENA_ALLOC_TAG;
@@ -1077,40 +1167,59 @@ CGHOST_API void *arena_calloc(Arena *arena, size_t count, size_t size) {
   return ptr;
 }
 
-CGHOST_API void arena_return(Arena *arena, void *ptr) {
+CGHOST_API size_t arena_usable_size(void *ptr) {
   if (!ptr)
-    return;
+    return 0;
+  ArenaAllocHeader *header = ARENA_ALLOC_HEADER(ptr);
+  return ALIGN_UP(sizeof(ArenaAllocHeader) + header->size, ARENA_ALIGNMENT) -
+         sizeof(ArenaAllocHeader);
+}
 
-  for (ArenaChunk **link = &arena->chunks; *link;) {
-    ArenaChunk *chunk = *link;
-    if ((char *)ptr >= chunk->memory &&
-        (char *)ptr < chunk->memory + ARENA_CHUNK_SIZE) {
+// Returns the chunk of ptr, aborts when ptr was not allocated from an arena.
+// The header is checked before the chunk is touched, so a foreign pointer is
+// caught without reading the memory its address masks to. Arenas are plain
+// values that may be moved, so chunks do not point back to theirs.
+static ArenaChunk *arena_chunk_checked(void *ptr) {
+  ArenaAllocHeader *header = ARENA_ALLOC_HEADER(ptr);
+  ArenaChunk *chunk = ARENA_CHUNK_OF(header);
+  if (header->owner != chunk) {
+    fprintf(stderr, "[Error] Pointer %p was not allocated from an arena\n",
+            ptr);
+    abort();
+  }
 
 #ifdef __CGHOST_MEMORY_DEBUG
-      ArenaAllocHeader *header = ARENA_ALLOC_HEADER(ptr);
-      if (header->owner != chunk) {
-        fprintf(stderr,
-                "[Error] Arena pointer does not match expected chunk\n");
-        abort();
-      }
+  if (header->tag != ARENA_ALLOC_TAG) {
+    fprintf(stderr, "[Error] Arena pointer does not match expected chunk\n");
+    abort();
+  }
 
-      if (((uintptr_t)ptr - (uintptr_t)chunk->memory) % ARENA_ALIGNMENT != 0) {
-        fprintf(stderr, "[Warning] Pointer not aligned to allocation unit\n");
-      }
+  if (((uintptr_t)ptr - (uintptr_t)chunk->memory) % ARENA_ALIGNMENT != 0) {
+    fprintf(stderr, "[Warning] Pointer not aligned to allocation unit\n");
+  }
 #endif
+  return chunk;
+}
 
-      if (chunk->ref_count > 0) {
-        chunk->ref_count--;
-        if (chunk->ref_count == 0) {
-          // reuse memory instead of freeing it
-          chunk->used = 0;
-          return;
-        }
-      }
-      return;
-    } else {
-      link = &(*link)->next;
-    }
+CGHOST_API void arena_return(Arena *arena, void *ptr) {
+  if (!ptr)
+    return;
+
+  ArenaChunk *chunk = arena_chunk_checked(ptr);
+
+  if (chunk->ref_count == 0 || --chunk->ref_count > 0)
+    return;
+
+  if (ARENA_CHUNK_IS_OVERSIZE(chunk)) {
+    arena_chunk_unlink(&arena->chunks, chunk);
+    free(chunk);
+  } else if (chunk == arena->chunks) {
+    // reuse memory instead of freeing it
+    chunk->used = 0;
+  } else {
+    arena_chunk_unlink(&arena->chunks, chunk);
+    chunk->used = 0;
+    arena_chunk_link(&arena->free_chunks, chunk);
   }
 }
 
@@ -1123,6 +1232,35 @@ CGHOST_API void *arena_realloc(Arena *arena, void *old_ptr, size_t old_size,
     return NULL;
   }
 
+  ArenaAllocHeader *header = ARENA_ALLOC_HEADER(old_ptr);
+  ArenaChunk *chunk = arena_chunk_checked(old_ptr);
+  size_t offset = (size_t)((char *)header - chunk->memory);
+  size_t old_total =
+      ALIGN_UP(sizeof(ArenaAllocHeader) + header->size, ARENA_ALIGNMENT);
+
+  if (new_size <= SIZE_MAX / 2) {
+    size_t new_total =
+        ALIGN_UP(sizeof(ArenaAllocHeader) + new_size, ARENA_ALIGNMENT);
+    if (ARENA_CHUNK_IS_OVERSIZE(chunk)) {
+      // the only allocation of its chunk, used stays at the capacity so that
+      // nothing is bumped past the first ARENA_CHUNK_SIZE bytes
+      if (offset + new_total <= chunk->capacity) {
+        header->size = new_size;
+        return old_ptr;
+      }
+    } else if (offset + old_total == chunk->used) {
+      if (offset + new_total <= chunk->capacity) {
+        chunk->used = offset + new_total;
+        header->size = new_size;
+        return old_ptr;
+      }
+    } else if (new_total <= old_total) {
+      header->size = new_size;
+      return old_ptr;
+    }
+  }
+
+  old_size = header->size;
   void *new_ptr = arena_alloc(arena, new_size);
   if (!new_ptr)
     return NULL;
@@ -1134,14 +1272,19 @@ CGHOST_API void *arena_realloc(Arena *arena, void *old_ptr, size_t old_size,
   return new_ptr;
 }
 
-CGHOST_API void arena_free(Arena *arena) {
-  ArenaChunk *chunk = arena->chunks;
+static void arena_chunks_free(ArenaChunk *chunk) {
   while (chunk) {
     ArenaChunk *next = chunk->next;
     free(chunk);
     chunk = next;
   }
+}
+
+CGHOST_API void arena_free(Arena *arena) {
+  arena_chunks_free(arena->chunks);
+  arena_chunks_free(arena->free_chunks);
   arena->chunks = NULL;
+  arena->free_chunks = NULL;
 }
 
 CGHOST_API CgAllocator arena_create_allocator(Arena *arena) {
@@ -1156,12 +1299,35 @@ CGHOST_API CgAllocator arena_create_allocator(Arena *arena) {
 
 // === Global arena wrappers ===
 
+// The address of garena differs per thread, so it cannot be stored in
+// garena_allocator, these look it up on every call instead
+static void *garena_allocator_malloc(void *a, size_t size) {
+  (void)a;
+  return arena_alloc(&garena, size);
+}
+
+static void *garena_allocator_calloc(void *a, size_t count, size_t size) {
+  (void)a;
+  return arena_calloc(&garena, count, size);
+}
+
+static void *garena_allocator_realloc(void *a, void *old_ptr, size_t old_size,
+                                      size_t new_size) {
+  (void)a;
+  return arena_realloc(&garena, old_ptr, old_size, new_size);
+}
+
+static void garena_allocator_free(void *a, void *ptr) {
+  (void)a;
+  arena_return(&garena, ptr);
+}
+
 CgAllocator garena_allocator = {
-    .allocator = &garena,
-    .malloc = (CgMallocFn)arena_alloc,
-    .calloc = (CgCallocFn)arena_calloc,
-    .realloc = (CgReallocFn)arena_realloc,
-    .free = (CgFreeFn)arena_return,
+    .allocator = NULL,
+    .malloc = garena_allocator_malloc,
+    .calloc = garena_allocator_calloc,
+    .realloc = garena_allocator_realloc,
+    .free = garena_allocator_free,
 };
 
 CGHOST_API void *garena_alloc(size_t size) {
@@ -1181,4 +1347,105 @@ CGHOST_API void garena_return(void *ptr) { arena_return(&garena, ptr); }
 
 CGHOST_API void garena_free(void) { arena_free(&garena); }
 
+// === Scratch ===
+
+CGHOST_API void scratch_init(Scratch *s, void *buffer, size_t size,
+                             CgAllocator fallback) {
+  uintptr_t begin = (uintptr_t)buffer;
+  size_t pad = ALIGN_UP(begin, ARENA_ALIGNMENT) - begin;
+  *s = (Scratch){
+      .memory = (char *)buffer + (pad < size ? pad : size),
+      .capacity = pad < size ? size - pad : 0,
+      .last = SIZE_MAX,
+      .fallback = fallback,
+  };
+}
+
+static inline bool scratch_owns(const Scratch *s, const void *ptr) {
+  return (const char *)ptr >= s->memory &&
+         (const char *)ptr < s->memory + s->capacity;
+}
+
+CGHOST_API void *scratch_alloc(Scratch *s, size_t size) {
+  // zero sized blocks take a unit too, a pointer at the end of the buffer
+  // would not be recognized as the scratch's own when it is returned
+  size_t total_size = ALIGN_UP(size ? size : 1, ARENA_ALIGNMENT);
+  if (size <= SIZE_MAX / 2 && s->capacity - s->used >= total_size) {
+    s->last = s->used;
+    s->used += total_size;
+    return s->memory + s->last;
+  }
+
+  if (NULL == s->fallback.malloc)
+    return NULL;
+  return s->fallback.malloc(s->fallback.allocator, size);
+}
+
+CGHOST_API void *scratch_calloc(Scratch *s, size_t count, size_t size) {
+  if (size != 0 && count > SIZE_MAX / size)
+    return NULL;
+  void *ptr = scratch_alloc(s, count * size);
+  if (ptr)
+    memset(ptr, 0, count * size);
+  return ptr;
+}
+
+CGHOST_API void *scratch_realloc(Scratch *s, void *old_ptr, size_t old_size,
+                                 size_t new_size) {
+  if (NULL == old_ptr)
+    return scratch_alloc(s, new_size);
+
+  if (!scratch_owns(s, old_ptr)) {
+    assert(NULL != s->fallback.realloc &&
+           "Pointer does not belong to the scratch");
+    return s->fallback.realloc(s->fallback.allocator, old_ptr, old_size,
+                               new_size);
+  }
+
+  // the last allocation grows or shrinks in place while it fits
+  size_t offset = (size_t)((char *)old_ptr - s->memory);
+  size_t total_size = ALIGN_UP(new_size, ARENA_ALIGNMENT);
+  if (offset == s->last && new_size <= SIZE_MAX / 2 &&
+      s->capacity - offset >= total_size) {
+    s->used = offset + total_size;
+    return old_ptr;
+  }
+
+  void *new_ptr = scratch_alloc(s, new_size);
+  if (new_ptr)
+    memcpy(new_ptr, old_ptr, old_size < new_size ? old_size : new_size);
+  return new_ptr;
+}
+
+CGHOST_API void scratch_return(Scratch *s, void *ptr) {
+  if (NULL == ptr)
+    return;
+
+  if (!scratch_owns(s, ptr)) {
+    if (NULL != s->fallback.free)
+      s->fallback.free(s->fallback.allocator, ptr);
+    return;
+  }
+
+  if ((size_t)((char *)ptr - s->memory) == s->last) {
+    s->used = s->last;
+    s->last = SIZE_MAX;
+  }
+}
+
+CGHOST_API void scratch_reset(Scratch *s) {
+  s->used = 0;
+  s->last = SIZE_MAX;
+}
+
+CGHOST_API CgAllocator scratch_create_allocator(Scratch *s) {
+  return (CgAllocator){
+      .allocator = s,
+      .malloc = (CgMallocFn)scratch_alloc,
+      .calloc = (CgCallocFn)scratch_calloc,
+      .realloc = (CgReallocFn)scratch_realloc,
+      .free = (CgFreeFn)scratch_return,
+  };
+}
+
 #endif // CGHOST_IMPLEMENTATION
@@ -12,11 +12,22 @@ typedef struct {
 } Note;
 
 sqlite3 *db;
+QkConn conn;
+
+void print_trace(const QkTraceEvent *ev, void *user_data) {
+  (void)user_data;
+  if (ev->raw)
+    return;
+  printf("Executing SQL: %s (%.1f us)\n", ev->sql,
+         (double)(ev->prepare_ns + ev->bind_ns + ev->step_ns) / 1000.0);
+}
 
 void init_test_db(const QkStructMapping *mapping) {
   const char *db_path = ":memory:"; // In-memory DB
   // const char *db_path = "notes.db";
   sqlite3_open(db_path, &db);
+  qk_set_trace_hook(print_trace, NULL);
+  qk_conn_init(&conn, db, QK_STMT_CACHE_CAPACITY);
 
   sqlite3_exec(db,
                "CREATE TABLE notes ("
@@ -67,14 +78,14 @@ void init_test_db(const QkStructMapping *mapping) {
   QkSqlQuery q = qk_sql_insert_many(STR("notes"), columns, params);
   qk_sql_conflic_resolution(&q, QK_CONFLICT_IGNORE);
 
-  qk_sql_exec_sqlite(&q, db, NULL);
+  qk_conn_exec(&conn, &q, NULL);
 
   qk_sql_query_free(&q);
 }
 
 bool exec_query_and_print_results(QkSqlQuery *q, QkStructMapping *m) {
   QkResultSet result = {0};
-  if (!qk_sql_exec_sqlite(q, db, &result))
+  if (!qk_conn_exec(&conn, q, &result))
     return false;
 
   for (size_t i = 0; i < result.rows.count; ++i) {
@@ -96,6 +107,7 @@ bool exec_query_and_print_results(QkSqlQuery *q, QkStructMapping *m) {
 #define CLEANUP                                                                \
   qk_sql_query_free(&q);                                                       \
   qk_struct_mapping_free(&note_mapping);                                       \
+  qk_conn_free(&conn);                                                         \
   sqlite3_close(db);                                                           \
   garena_free();
 
@@ -114,7 +126,7 @@ int main(void) {
 
   init_test_db(&note_mapping);
 
-  QkSqlQuery q = qk_sql_select(STR("notes"), STR("*"));
+  QkSqlQuery q = qk_sql_select_struct(STR("notes"), &note_mapping);
   // qk_sql_where(&q, QK_FILT_LT, STR("id"), qk_int(3));
   if (!exec_query_and_print_results(&q, &note_mapping)) {
     CLEANUP;
@@ -123,9 +135,13 @@ int main(void) {
   qk_sql_query_free(&q);
   printf("====================================\n");
 
+  // both writes share one commit
+  qk_conn_begin(&conn, QK_TX_IMMEDIATE);
+
   q = qk_sql_delete(STR("notes"));
   qk_sql_where(&q, QK_FILT_EQ, STR("id"), qk_int(2));
   if (!exec_query_and_print_results(&q, &note_mapping)) {
+    qk_conn_rollback(&conn);
     CLEANUP;
     return 1;
   }
@@ -134,12 +150,19 @@ int main(void) {
   q = qk_sql_update(STR("notes"), STR("title"), qk_cstr("Pasta Carbonara"));
   qk_sql_where(&q, QK_FILT_EQ, STR("id"), qk_int(1));
   if (!exec_query_and_print_results(&q, &note_mapping)) {
+    qk_conn_rollback(&conn);
     CLEANUP;
     return 1;
   }
   qk_sql_query_free(&q);
 
-  q = qk_sql_select(STR("notes"), STR("*"));
+  if (!qk_conn_commit(&conn)) {
+    CLEANUP;
+    return 1;
+  }
+
+  // only id and title are read, the other fields stay zeroed
+  q = qk_sql_select_struct_only(STR("notes"), &note_mapping, "id", "title");
   if (!exec_query_and_print_results(&q, &note_mapping)) {
     CLEANUP;
     return 1;
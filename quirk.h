@@ -2,8 +2,10 @@
 #define __QUIRK_H__
 
 #include <assert.h>
+#include <pthread.h>
 #include <sqlite3.h>
 #include <stdio.h>
+#include <time.h>
 
 #include "cghost.h"
 
@@ -54,13 +56,15 @@ typedef enum {
   QK_INT,
   QK_DOUBLE,
   QK_STR,
+  QK_BLOB,     // bytes held in as.s
+  QK_ZEROBLOB, // as.i zero bytes, only as a parameter
 } QkParamKind;
 
 typedef struct QkValue {
   QkParamKind kind;
   union {
     bool b;
-    int i;
+    int64_t i;
     double d;
     Str s;
   } as;
@@ -83,6 +87,24 @@ DA_DECL_TYPE(QkParamArr, QkParamRows)
 
 #define qk_cstr(s_) qk_str(str_from_cstr((s_)))
 
+#define qk_blob(s_)                                                            \
+  (QkParam) { .kind = QK_BLOB, .as.s = (s_) }
+
+#define qk_blob_from(ptr_, len_)                                               \
+  qk_blob(str_from_sv(                                                         \
+      (StringView){.begin = (const char *)(ptr_), .length = (len_)}))
+
+#define qk_zeroblob(n_)                                                        \
+  (QkParam) { .kind = QK_ZEROBLOB, .as.i = (n_) }
+
+// kinds whose value is a Str owned by the param
+#define qk_param_has_str(p) ((p).kind == QK_STR || (p).kind == QK_BLOB)
+
+typedef enum {
+  QK_BIND_TRANSIENT, // SQLite makes its own copy of text and blobs
+  QK_BIND_STATIC,    // bound in place, see qk_bind_param_sqlite_mode
+} QkBindMode;
+
 typedef struct QkColVal {
   Str column;
   QkParam param;
@@ -115,6 +137,13 @@ typedef struct QkSqlQuery {
     QkOrder order;
   } order_by;
 
+  // keyset pagination, used for select, see qk_sql_page
+  struct {
+    StrArr keys;
+    QkParamArr after; // key of the last row seen, empty for the first page
+    QkOrder order;
+  } page;
+
   int limit; // negative value means no limit
 
   StringBuilder b;
@@ -133,10 +162,326 @@ typedef struct {
 
 DA_STRUCT(QkResultRow, QkResultRowArr)
 
+// Everything in a result, rows included, lives in arena and is released at
+// once by qk_result_set_free, whatever allocator is current. A result can be
+// freed by another thread than the one that filled it. Strings taken from a
+// result must not be freed individually and do not outlive it.
 typedef struct {
   QkResultRowArr rows;
+  Arena arena;
 } QkResultSet;
 
+// Most queries filter on a handful of columns
+#ifndef QK_WHERE_INIT_CAPACITY
+#define QK_WHERE_INIT_CAPACITY 4
+#endif
+
+// Enough for a select or update with a few columns and conditions. Queries are
+// built with the current allocator and are freed with it, so a point query
+// built under scratch_create_allocator over a stack buffer of this many bytes
+// does not touch the heap once its shape is in the shape cache (the first
+// build of a shape copies the SQL into the cache with std_malloc).
+#ifndef QK_SCRATCH_QUERY_SIZE
+#define QK_SCRATCH_QUERY_SIZE 2048
+#endif
+
+#ifndef QK_SHAPE_CACHE_SIZE
+#define QK_SHAPE_CACHE_SIZE 256
+#endif
+
+// Slots a shape may take in the shape cache, starting at its hash
+#ifndef QK_SHAPE_CACHE_PROBES
+#define QK_SHAPE_CACHE_PROBES 4
+#endif
+
+#ifndef QK_STMT_CACHE_CAPACITY
+#define QK_STMT_CACHE_CAPACITY 64
+#endif
+
+typedef struct {
+  uint64_t hash; // hash of the SQL text the statement was prepared from
+  uint64_t last_used;
+  sqlite3_stmt *stmt;
+  bool in_use; // checked out, so it can not be evicted
+} QkStmtCacheEntry;
+
+DA_STRUCT(QkStmtCacheEntry, QkStmtCacheEntryArr)
+
+// LRU cache of prepared statements keyed on the built SQL text
+typedef struct {
+  QkStmtCacheEntryArr entries;
+  size_t capacity; // zero disables caching
+  uint64_t tick;
+
+  // counters, never reset by the library
+  size_t hits;
+  size_t misses;
+  size_t evictions;
+} QkStmtCache;
+
+typedef enum {
+  QK_TX_DEFERRED,
+  QK_TX_IMMEDIATE,
+  QK_TX_EXCLUSIVE,
+} QkTxMode;
+
+// Connection wrapper that keeps per-connection state (statement cache,
+// transaction nesting). QkConn does not own db, closing it is up to the
+// caller.
+typedef struct {
+  sqlite3 *db;
+  QkStmtCache stmts;
+
+  size_t tx_depth;        // number of open qk_conn_begin levels
+  bool tx_root_savepoint; // outermost level is a savepoint (outer tx exists)
+} QkConn;
+
+#ifndef QK_POOL_BUSY_TIMEOUT_MS
+#define QK_POOL_BUSY_TIMEOUT_MS 5000
+#endif
+
+typedef struct {
+  QkConn conn;
+  pthread_t owner; // thread that acquired it last, preferred by that thread
+  bool has_owner;
+  bool busy;
+} QkPoolEntry;
+
+// counters, never reset by the library
+typedef struct {
+  size_t acquires;
+  size_t releases;
+  size_t affinity_hits; // the thread got back the connection it used last
+  size_t waits;         // every connection was busy and the thread blocked
+  uint64_t wait_ns;
+  size_t in_use;
+  size_t max_in_use;
+} QkPoolStats;
+
+// Fixed set of connections to one database file, opened in WAL mode so
+// readers run concurrently. Each connection keeps its own statement cache and
+// is used by one thread at a time.
+typedef struct {
+  QkPoolEntry *entries;
+  size_t count;
+  pthread_mutex_t lock;
+  pthread_cond_t available;
+  QkPoolStats stats;
+} QkPool;
+
+#ifndef QK_WRITE_BATCH_MAX
+#define QK_WRITE_BATCH_MAX 128
+#endif
+
+#ifndef QK_WRITE_BATCH_DELAY_US
+#define QK_WRITE_BATCH_DELAY_US 1000
+#endif
+
+// One write submitted to a QkWriteQueue. Storage belongs to the submitter
+// and must stay valid, together with q, until the request is done.
+typedef struct QkWriteRequest {
+  QkSqlQuery *q;
+  bool done;
+  bool ok;
+  size_t rows_changed;
+  struct QkWriteRequest *next;
+} QkWriteRequest;
+
+// counters, never reset by the library
+typedef struct {
+  size_t batches;
+  size_t requests;
+  size_t failed;
+  size_t largest_batch;
+} QkWriteQueueStats;
+
+// Single writer thread with its own connection. Submitted writes are grouped
+// into one transaction per batch, each write runs in its own savepoint so a
+// failing one does not take the rest of the batch with it.
+typedef struct {
+  QkConn conn;
+  pthread_t thread;
+  pthread_mutex_t lock;
+  pthread_cond_t pending;   // signals the writer
+  pthread_cond_t completed; // signals submitters
+
+  QkWriteRequest *head;
+  QkWriteRequest *tail;
+  size_t queued;
+
+  size_t max_batch;
+  uint64_t max_delay_ns;
+  bool stopping;
+
+  QkWriteQueueStats stats;
+} QkWriteQueue;
+
+typedef struct QkFuture QkFuture;
+typedef void (*QkFutureFn)(QkFuture *f, void *user_data);
+
+// Handle of a query submitted to QkAsync. Storage belongs to the submitter and
+// must stay valid, together with q, until the query completed. result is
+// owned by the submitter once completed and freed with qk_result_set_free.
+struct QkFuture {
+  QkSqlQuery *q;
+  QkFutureFn on_done; // called on the worker thread, NULL to wait instead
+  void *user_data;
+
+  QkResultSet result;
+  bool ok;
+  bool done; // only set for futures without a callback
+
+  QkFuture *next;
+};
+
+// Worker threads executing queries on connections of a QkPool
+typedef struct {
+  QkPool *pool;
+  pthread_t *threads;
+  size_t thread_count;
+
+  pthread_mutex_t lock;
+  pthread_cond_t pending;   // signals workers
+  pthread_cond_t completed; // signals waiters
+
+  QkFuture *head;
+  QkFuture *tail;
+  bool stopping;
+} QkAsync;
+
+typedef struct {
+  Str column;
+  int idx;   // SQLite parameter index (1-based)
+  Str value; // text bound in place, released when rebound or freed
+} QkBindSlot;
+
+DA_STRUCT(QkBindSlot, QkBindSlotArr)
+
+// Prepared form of a QkSqlQuery. Keeps the statement and the positions of its
+// parameters so that values can be rebound and the query executed again
+// without building or preparing SQL.
+typedef struct {
+  QkOp op;
+  sqlite3 *db;
+  sqlite3_stmt *stmt;
+
+  // SET values for update, VALUES for insert (all rows, row-major)
+  QkBindSlotArr params;
+
+  QkBindSlotArr where;
+} QkCompiledQuery;
+
+DA_STRUCT(int64_t, QkInt64Arr)
+DA_STRUCT(double, QkDoubleArr)
+DA_STRUCT(size_t, QkOffsetArr)
+DA_STRUCT(uint8_t, QkBitmap)
+
+// One column of a QkColumnarResult. Only the array matching kind is filled:
+// ints for QK_INT, doubles for QK_DOUBLE, offsets and bytes for QK_STR and
+// QK_BLOB (row i spans bytes[offsets[i], offsets[i + 1])). NULL cells are
+// marked in nulls and hold zero (or an empty span) in the value array.
+typedef struct {
+  Str name;
+  QkParamKind kind; // QK_PARAM_NULL while every value seen so far is NULL
+  QkInt64Arr ints;
+  QkDoubleArr doubles;
+  QkOffsetArr offsets;
+  StringBuilder bytes;
+  QkBitmap nulls;
+} QkColumn;
+
+DA_STRUCT(QkColumn, QkColumnArr)
+
+// Column-major result set: the schema (name and kind) is stored once per
+// column and values live in contiguous typed arrays.
+typedef struct {
+  QkColumnArr columns;
+  size_t row_count;
+} QkColumnarResult;
+
+#define qk_column_is_null(col, row)                                            \
+  (((col)->nulls.items[(row) >> 3] >> ((row) & 7)) & 1)
+
+#define qk_column_text(col, row)                                               \
+  ((StringView){                                                               \
+      .begin = (col)->bytes.items + (col)->offsets.items[(row)],               \
+      .length = (col)->offsets.items[(row) + 1] - (col)->offsets.items[(row)], \
+  })
+
+// Incremental access to one blob. Blobs can not change size this way, insert
+// a QK_ZEROBLOB of the final size first and fill it with writes.
+typedef struct {
+  sqlite3 *db;
+  sqlite3_blob *blob;
+  size_t size;
+  size_t offset; // position of the next sequential read or write
+  bool failed;
+} QkBlobStream;
+
+#ifndef QK_BULK_CHUNK_ROWS
+#define QK_BULK_CHUNK_ROWS 256
+#endif
+
+typedef struct {
+  size_t rows;
+  size_t chunks;
+  double seconds;
+  double rows_per_sec;
+} QkBulkStats;
+
+// Reported once per execution to the hook set with qk_set_trace_hook.
+// Timings are in nanoseconds. sql is only valid during the callback.
+typedef struct {
+  const char *sql;
+  QkOp op;
+  bool raw; // statement issued by quirk itself (transactions), op is unset
+  bool cached; // statement came from a QkConn statement cache
+  bool ok;
+
+  uint64_t prepare_ns;
+  uint64_t bind_ns;
+  uint64_t step_ns;
+
+  size_t rows_returned;
+  size_t rows_changed;
+  size_t bytes_materialized;
+} QkTraceEvent;
+
+typedef void (*QkTraceFn)(const QkTraceEvent *ev, void *user_data);
+
+typedef struct {
+  QkTraceFn fn;
+  void *user_data;
+} QkTraceHook;
+
+// Measures one execution, does nothing unless a hook is set. The hook is read
+// once when the execution starts and that copy is the one reported to.
+typedef struct {
+  QkTraceEvent ev;
+  QkTraceHook hook;
+  uint64_t t;
+  bool on;
+} QkTrace;
+
+// Streams the rows of a statement one at a time. The statement is either
+// owned by the cursor, checked out of a QkConn or borrowed from a
+// QkCompiledQuery, and is released accordingly by qk_cursor_close.
+typedef struct {
+  sqlite3 *db;
+  sqlite3_stmt *stmt;
+  QkConn *conn;   // set when stmt is checked out of conn
+  bool owns_stmt; // stmt is finalized on close
+  bool failed;    // set when stepping failed, qk_cursor_next returns false
+
+  QkResultRow row; // current row, only materialized by qk_cursor_row
+  bool row_ready;
+  StrArr names; // column names shared by the materialized rows
+
+  QkTraceEvent trace; // reported on close when a trace hook is set
+  QkTraceHook trace_hook; // read at open
+  bool tracing;
+} QkCursor;
+
 typedef struct {
   StringView column_name;
   size_t offset;
@@ -152,6 +497,8 @@ typedef struct {
 
 DA_DECL_TYPE(QkStructField, QkStructFieldArr)
 
+// How QK_STR fields are represented in the struct. QK_BLOB fields are always
+// a Str holding the bytes.
 typedef enum {
   QK_STR_TO_STR,
   QK_STR_TO_SV,
@@ -159,9 +506,40 @@ typedef enum {
   QK_STR_TO_CSTR,
 } QkStringMapping;
 
+#ifndef QK_MAPPING_SCHEMA_CACHE
+#define QK_MAPPING_SCHEMA_CACHE 8
+#endif
+
+typedef struct {
+  uint64_t hash; // hash of the lowercase column name
+  size_t field;  // index into QkStructMapping.fields
+} QkFieldHash;
+
+// Resolved column -> field plan for one result schema
+typedef struct {
+  uint64_t schema; // hash of the lowercase column names, in order
+  size_t col_count;
+  int *field_for_col; // -1 when no field maps the column
+  const char *names;  // the column names, each NUL terminated
+  size_t names_len;
+} QkSchemaPlan;
+
+// Built by qk_struct_mapping_compile. Mapping with a compiled mapping updates
+// its schema cache, so a compiled mapping must not be shared between threads.
+// The index and the cached plans are allocated with the allocator that was
+// current at compile time, whatever is current when rows are mapped.
+typedef struct QkMappingIndex {
+  CgAllocator allocator;
+  QkFieldHash *by_hash; // sorted by hash
+  size_t count;
+  QkSchemaPlan plans[QK_MAPPING_SCHEMA_CACHE];
+  size_t next_plan;
+} QkMappingIndex;
+
 typedef struct {
   QkStructFieldArr fields;
   QkStringMapping string_mapping;
+  QkMappingIndex *index; // NULL until compiled
 } QkStructMapping;
 
 // === Function declarations ===
@@ -174,6 +552,20 @@ typedef struct {
 
 QkSqlQuery qk_sql_select(Str table, Str column);
 QkSqlQuery qk_sql_select_many(Str table, StrArr columns);
+// Selects the columns of the fields of mapping instead of *, so columns the
+// struct does not map never leave SQLite
+QkSqlQuery qk_sql_select_struct(Str table, const QkStructMapping *mapping);
+// Selects only the listed fields of mapping (by column name), names that the
+// mapping does not have are reported and skipped. Building the query fails when
+// no name is left.
+QkSqlQuery qk_sql_select_struct_fields(Str table,
+                                       const QkStructMapping *mapping,
+                                       const char *const *fields,
+                                       size_t count);
+#define qk_sql_select_struct_only(table, mapping, ...)                         \
+  qk_sql_select_struct_fields(                                                 \
+      (table), (mapping), (const char *const[]){__VA_ARGS__},                  \
+      sizeof((const char *const[]){__VA_ARGS__}) / sizeof(const char *))
 QkSqlQuery qk_sql_update(Str table, Str column, QkParam param);
 QkSqlQuery qk_sql_update_many(Str table, StrArr columns, QkParamArr params);
 QkSqlQuery qk_sql_insert(Str table, StrArr columns, QkParamArr params);
@@ -184,18 +576,329 @@ void qk_sql_conflic_resolution(QkSqlQuery *q, QkConflictResolution conflic);
 void qk_sql_where(QkSqlQuery *q, QkFilter filt, Str column, QkParam param);
 void qk_sql_order_by(QkSqlQuery *q, Str column, QkOrder order);
 void qk_sql_limit(QkSqlQuery *q, int limit);
+// Keyset pagination: pages of page_size rows ordered by keys (moved in, most
+// significant first), each page continues with WHERE (keys) > (last key)
+// instead of an offset, so deep pages cost as much as the first one. The keys
+// together must be unique and not NULL, and must be selected. Sets order by
+// and limit, do not set them separately.
+void qk_sql_page(QkSqlQuery *q, StrArr keys, QkOrder order, int page_size);
+// Continuation token for the page that ended with row, an opaque printable
+// string written to *out (allocated with the current allocator). A page with
+// less than page_size rows is the last one.
+bool qk_page_token(const QkSqlQuery *q, const QkResultRow *row, Str *out);
+// Positions a paged query right after the row the token was taken from
+bool qk_sql_page_continue(QkSqlQuery *q, StringView token);
+// Rendered SQL is cached process-wide by query shape (everything but the
+// parameter values), building a query of a known shape only copies the text.
 bool qk_sql_build(QkSqlQuery *q, QkSqlDialect dialect);
+// Frees the cached SQL, for leak checkers at exit. No other thread may be
+// building queries meanwhile.
+void qk_shape_cache_clear(void);
+// Registers a process-wide hook called after every execution. Pass NULL to
+// remove it, nothing is measured while no hook is set. It may be changed while
+// other threads execute, executions already started report to the old hook.
+void qk_set_trace_hook(QkTraceFn fn, void *user_data);
 bool qk_bind_param_sqlite(sqlite3_stmt *stmt, int idx, QkParam *p);
+// With QK_BIND_STATIC text is not copied by SQLite, it must stay alive until
+// the parameter is rebound, the bindings are cleared or the statement is
+// finalized. Queries executed by quirk are bound this way.
+bool qk_bind_param_sqlite_mode(sqlite3_stmt *stmt, int idx, QkParam *p,
+                               QkBindMode mode);
 bool qk_sql_exec_sqlite(QkSqlQuery *q, sqlite3 *db, QkResultSet *out);
 void qk_sql_query_free(QkSqlQuery *q);
+
+// Statements prepared through QkConn are cached and reused between calls with
+// the same SQL text. qk_conn_prepare checks a statement out of the cache,
+// qk_conn_release resets it, clears its bindings and puts it back (or
+// finalizes it if it was not cached). Pass QK_STMT_CACHE_CAPACITY for the
+// default capacity.
+void qk_conn_init(QkConn *c, sqlite3 *db, size_t stmt_cache_capacity);
+void qk_conn_free(QkConn *c);
+sqlite3_stmt *qk_conn_prepare(QkConn *c, const char *sql);
+void qk_conn_release(QkConn *c, sqlite3_stmt *stmt);
+bool qk_conn_exec(QkConn *c, QkSqlQuery *q, QkResultSet *out);
+
+// Transactions. The outermost qk_conn_begin starts a transaction in the given
+// mode, nested calls open savepoints (mode is ignored for them). Every begin
+// must be matched by a commit or a rollback of that level. If the connection
+// is already inside a transaction that was not started through QkConn, the
+// outermost level is a savepoint too. A failed commit leaves the level open.
+bool qk_conn_begin(QkConn *c, QkTxMode mode);
+bool qk_conn_commit(QkConn *c);
+bool qk_conn_rollback(QkConn *c);
+
+// Connection pool. qk_pool_acquire blocks until a connection is free and
+// prefers the one the calling thread used last. A connection is released with
+// the transaction it was acquired with closed, open levels are rolled back.
+// path must name a file, every connection to ":memory:" is its own database.
+bool qk_pool_open(QkPool *p, const char *path, size_t size,
+                  size_t stmt_cache_capacity);
+void qk_pool_close(QkPool *p);
+QkConn *qk_pool_acquire(QkPool *p);
+void qk_pool_release(QkPool *p, QkConn *c);
+QkPoolStats qk_pool_stats(QkPool *p);
+bool qk_pool_exec(QkPool *p, QkSqlQuery *q, QkResultSet *out);
+
+// Group commit. A batch is taken once max_batch writes are queued or
+// max_delay_us passed since the first one arrived (0 for the defaults). The
+// SQL is built by qk_write_queue_submit in the submitting thread, the writer
+// only prepares, binds and steps. qk_write_queue_stop executes what is still
+// queued and joins the writer.
+bool qk_write_queue_start(QkWriteQueue *wq, const char *path, size_t max_batch,
+                          uint64_t max_delay_us);
+void qk_write_queue_stop(QkWriteQueue *wq);
+bool qk_write_queue_submit(QkWriteQueue *wq, QkWriteRequest *r);
+bool qk_write_queue_wait(QkWriteQueue *wq, QkWriteRequest *r);
+// Submits q and waits for it
+bool qk_write_queue_exec(QkWriteQueue *wq, QkSqlQuery *q);
+QkWriteQueueStats qk_write_queue_stats(QkWriteQueue *wq);
+
+// Asynchronous execution. threads workers (0 for one per pool connection)
+// take submitted queries in order and run them on a connection acquired from
+// pool. The SQL is built by qk_async_submit in the calling thread. On
+// completion on_done is called on the worker thread, the worker does not touch
+// f after that, so the callback may free it. Without a callback wait for f
+// with qk_future_wait or poll it with qk_future_ready. qk_async_stop executes
+// what is still queued and joins the workers, the pool is not closed.
+bool qk_async_start(QkAsync *a, QkPool *pool, size_t threads);
+void qk_async_stop(QkAsync *a);
+bool qk_async_submit(QkAsync *a, QkFuture *f, QkSqlQuery *q,
+                     QkFutureFn on_done, void *user_data);
+bool qk_future_wait(QkAsync *a, QkFuture *f);
+bool qk_future_ready(QkAsync *a, QkFuture *f);
+
+// Compiled queries are created from a QkSqlQuery and bound with its current
+// values. The query itself is not retained, so it can be freed right after
+// compilation. Binding by name matches the first slot with that column (for
+// insert, the first row), use positions when a column appears more than once.
+// Bindings are kept between executions. Text is bound without copying: the
+// handle keeps the passed Str (moved in) until it is rebound or freed. The
+// seek values of a paged query are where slots following the conditions.
+bool qk_sql_compile_sqlite(QkSqlQuery *q, sqlite3 *db, QkCompiledQuery *out);
+bool qk_compiled_bind_param(QkCompiledQuery *cq, size_t i, QkParam p);
+bool qk_compiled_bind_param_by_name(QkCompiledQuery *cq, StringView column,
+                                    QkParam p);
+bool qk_compiled_bind_where(QkCompiledQuery *cq, size_t i, QkParam p);
+bool qk_compiled_bind_where_by_name(QkCompiledQuery *cq, StringView column,
+                                    QkParam p);
+bool qk_compiled_exec(QkCompiledQuery *cq, QkResultSet *out);
+void qk_compiled_free(QkCompiledQuery *cq);
+
+// Inserts the rows of an insert query in chunks of at most chunk_rows rows (0
+// means QK_BULK_CHUNK_ROWS), capped so that a chunk never exceeds SQLite's
+// variable limit. Full chunks share one cached statement and the remainder
+// uses another. Everything runs in one transaction, or in a savepoint when the
+// connection is already inside one. stats may be NULL.
+bool qk_conn_bulk_insert(QkConn *c, QkSqlQuery *q, size_t chunk_rows,
+                         QkBulkStats *stats);
+
+// Columnar execution, column kinds are taken from the first non NULL value
+// of each column and later values are converted to that kind by SQLite.
+bool qk_sql_exec_columnar_sqlite(QkSqlQuery *q, sqlite3 *db,
+                                 QkColumnarResult *out);
+bool qk_conn_exec_columnar(QkConn *c, QkSqlQuery *q, QkColumnarResult *out);
+QkColumn *qk_columnar_find(QkColumnarResult *res, StringView name);
+void qk_columnar_result_free(QkColumnarResult *res);
+
+// Cursors keep memory constant: only the current row is available and it is
+// valid until the next call to qk_cursor_next. Text returned by
+// qk_cursor_text and the row returned by qk_cursor_row follow the same rule.
+// The query a cursor was opened with must outlive it (parameters are bound in
+// place).
+bool qk_cursor_open(QkCursor *cur, QkSqlQuery *q, sqlite3 *db);
+bool qk_conn_cursor_open(QkCursor *cur, QkConn *c, QkSqlQuery *q);
+bool qk_compiled_cursor_open(QkCursor *cur, QkCompiledQuery *cq);
+bool qk_cursor_next(QkCursor *cur);
+int qk_cursor_column_count(QkCursor *cur);
+StringView qk_cursor_column_name(QkCursor *cur, int i);
+bool qk_cursor_is_null(QkCursor *cur, int i);
+int qk_cursor_int(QkCursor *cur, int i);
+int64_t qk_cursor_int64(QkCursor *cur, int i);
+double qk_cursor_double(QkCursor *cur, int i);
+StringView qk_cursor_text(QkCursor *cur, int i);
+StringView qk_cursor_blob(QkCursor *cur, int i);
+QkResultRow *qk_cursor_row(QkCursor *cur);
+void qk_cursor_close(QkCursor *cur);
+
+// Blob streams read and write at offset and advance it, qk_blob_stream_read
+// returns the number of bytes read (0 at the end or on error, see failed).
+// qk_blob_stream_reopen moves the stream to another row of the same column.
+bool qk_blob_stream_open(QkBlobStream *bs, sqlite3 *db, const char *table,
+                         const char *column, int64_t rowid, bool writable);
+bool qk_blob_stream_reopen(QkBlobStream *bs, int64_t rowid);
+size_t qk_blob_stream_read(QkBlobStream *bs, void *buf, size_t n);
+bool qk_blob_stream_write(QkBlobStream *bs, const void *buf, size_t n);
+bool qk_blob_stream_seek(QkBlobStream *bs, size_t offset);
+void qk_blob_stream_close(QkBlobStream *bs);
+
 void qk_result_set_free(QkResultSet *res);
 void qk_struct_mapping_free(QkStructMapping *m);
+// Precomputes hashed field lookup so mapping rows is O(columns). Must be
+// called again if fields change.
+void qk_struct_mapping_compile(QkStructMapping *m);
 void qk_map_row_to_struct(QkResultRow *row, const QkStructMapping *mapping,
                           void *struct_ptr);
 void qk_map_struct_to_cols_and_values(const void *struct_ptr,
                                       const QkStructMapping *mapping,
                                       StrArr *out_columns,
                                       QkParamArr *out_values);
+
+// Fetch rows straight into an array of structs described by mapping, without
+// going through QkResultSet. Columns are matched to fields once per statement.
+// The array (*items, *count, *capacity) is grown with the current allocator,
+// new rows are appended zero initialized. Text is copied once: with
+// QK_STR_TO_SV the view points to a copy allocated with the current allocator
+// that the caller owns.
+bool qk_sql_fetch_sqlite(QkSqlQuery *q, sqlite3 *db,
+                         const QkStructMapping *mapping, void **items,
+                         size_t *count, size_t *capacity, size_t item_size);
+bool qk_conn_fetch(QkConn *c, QkSqlQuery *q, const QkStructMapping *mapping,
+                   void **items, size_t *count, size_t *capacity,
+                   size_t item_size);
+
+// da is any dynamic array of the mapped struct
+#define qk_sql_fetch_da_sqlite(q, db, mapping, da)                             \
+  qk_sql_fetch_sqlite((q), (db), (mapping), (void **)&(da).items,             \
+                      &(da).count, &(da).capacity, sizeof(*(da).items))
+#define qk_conn_fetch_da(c, q, mapping, da)                                    \
+  qk_conn_fetch((c), (q), (mapping), (void **)&(da).items, &(da).count,       \
+                &(da).capacity, sizeof(*(da).items))
+
+// Static queries. When the shape of a query is known at compile time its SQL
+// is spelled out by the QK_STATIC_* macros as a single string literal, the
+// pieces are concatenated by the compiler:
+//
+//   QK_STATIC_SELECT(users, id, name) QK_STATIC_WHERE(QK_STATIC_GE(age))
+//       QK_STATIC_ORDER_BY(name, ASC) QK_STATIC_LIMIT(10)
+//
+// Up to 16 columns and conditions.
+#define QK_STATIC_SELECT(table, ...)                                           \
+  "SELECT " QK__JOIN(QK__NAME_SQL, ", ", __VA_ARGS__) " FROM " #table
+#define QK_STATIC_UPDATE(table, ...)                                           \
+  "UPDATE " #table " SET " QK__JOIN(QK__SET_SQL, ", ", __VA_ARGS__)
+#define QK_STATIC_INSERT(table, ...)                                           \
+  "INSERT INTO " #table " (" QK__JOIN(QK__NAME_SQL, ", ", __VA_ARGS__)        \
+  ") VALUES (" QK__JOIN(QK__HOLE_SQL, ", ", __VA_ARGS__) ")"
+#define QK_STATIC_DELETE(table) "DELETE FROM " #table
+
+#define QK_STATIC_WHERE(...) " WHERE " QK__JOIN(QK__ID, " AND ", __VA_ARGS__)
+#define QK_STATIC_EQ(column) #column " = ?"
+#define QK_STATIC_NEQ(column) #column " != ?"
+#define QK_STATIC_GT(column) #column " > ?"
+#define QK_STATIC_LT(column) #column " < ?"
+#define QK_STATIC_LE(column) #column " <= ?"
+#define QK_STATIC_GE(column) #column " >= ?"
+// order is ASC or DESC
+#define QK_STATIC_ORDER_BY(column, order) " ORDER BY " #column " " #order
+#define QK_STATIC_LIMIT(n) " LIMIT " #n
+
+// QK_STATIC_QUERY(fn, sql, (type, name)...) defines the string fn_sql and
+//   static inline bool fn(QkConn *c, QkResultSet *out, type name...)
+// which binds its arguments in order, picking the binding by their C type,
+// and runs fn_sql through the statement cache of c. Nothing is allocated
+// besides the result rows. Text arguments (char *, StringView, Str) are bound
+// without copying, a NULL string binds NULL. Integers of any width bind as
+// integers, unsigned values above INT64_MAX wrap. Up to 16 arguments.
+#define QK_STATIC_QUERY(fn, ...)                                               \
+  QK__CAT(QK__STATIC_QUERY_, QK__HAS_ARGS(__VA_ARGS__))(fn, __VA_ARGS__)
+
+#define qk_static_bind(stmt, i, v)                                             \
+  _Generic((v),                                                                \
+      bool: qk_static_bind_bool,                                               \
+      char: qk_static_bind_int,                                                \
+      signed char: qk_static_bind_int,                                         \
+      unsigned char: qk_static_bind_int,                                       \
+      short: qk_static_bind_int,                                               \
+      unsigned short: qk_static_bind_int,                                      \
+      int: qk_static_bind_int,                                                 \
+      unsigned: qk_static_bind_int64,                                          \
+      long: qk_static_bind_int64,                                              \
+      unsigned long: qk_static_bind_int64,                                     \
+      long long: qk_static_bind_int64,                                         \
+      unsigned long long: qk_static_bind_int64,                                \
+      float: qk_static_bind_double,                                            \
+      double: qk_static_bind_double,                                           \
+      char *: qk_static_bind_text,                                             \
+      const char *: qk_static_bind_text,                                       \
+      StringView: qk_static_bind_sv,                                           \
+      Str: qk_static_bind_str)((stmt), (i), (v))
+
+// Used by the functions defined with QK_STATIC_QUERY. qk_static_prepare
+// checks sql out of the cache of c, qk_static_exec steps the statement when
+// every argument was bound and releases it.
+sqlite3_stmt *qk_static_prepare(QkConn *c, const char *sql, QkTrace *t);
+bool qk_static_exec(QkConn *c, sqlite3_stmt *stmt, bool bound,
+                    QkResultSet *out, QkTrace *t);
+bool qk_static_bind_bool(sqlite3_stmt *stmt, int i, bool v);
+bool qk_static_bind_int(sqlite3_stmt *stmt, int i, int v);
+bool qk_static_bind_int64(sqlite3_stmt *stmt, int i, int64_t v);
+bool qk_static_bind_double(sqlite3_stmt *stmt, int i, double v);
+bool qk_static_bind_text(sqlite3_stmt *stmt, int i, const char *v);
+bool qk_static_bind_sv(sqlite3_stmt *stmt, int i, StringView v);
+bool qk_static_bind_str(sqlite3_stmt *stmt, int i, Str v);
+
+#define QK__STATIC_QUERY_0(fn, sql)                                            \
+  static const char fn##_sql[] = sql;                                          \
+  static inline bool fn(QkConn *c, QkResultSet *out) {                         \
+    QkTrace t;                                                                 \
+    sqlite3_stmt *stmt = qk_static_prepare(c, fn##_sql, &t);                   \
+    return NULL != stmt && qk_static_exec(c, stmt, true, out, &t);             \
+  }
+#define QK__STATIC_QUERY_1(fn, sql, ...)                                       \
+  static const char fn##_sql[] = sql;                                          \
+  static inline bool fn(QkConn *c,                                             \
+                        QkResultSet *out QK__JOIN(QK__ARG_DECL, ,             \
+                                                  __VA_ARGS__)) {              \
+    QkTrace t;                                                                 \
+    sqlite3_stmt *stmt = qk_static_prepare(c, fn##_sql, &t);                   \
+    if (NULL == stmt)                                                          \
+      return false;                                                            \
+    int i = 0;                                                                 \
+    bool bound = true QK__JOIN(QK__ARG_BIND, , __VA_ARGS__);                   \
+    return qk_static_exec(c, stmt, bound, out, &t);                            \
+  }
+
+#define QK__ID(x) x
+#define QK__NAME_SQL(column) #column
+#define QK__SET_SQL(column) #column " = ?"
+#define QK__HOLE_SQL(column) "?"
+#define QK__ARG_DECL(arg) , QK__ARG_DECL_ arg
+#define QK__ARG_DECL_(type, name) type name
+#define QK__ARG_BIND(arg) &&qk_static_bind(stmt, ++i, QK__ARG_NAME_ arg)
+#define QK__ARG_NAME_(type, name) name
+
+#define QK__CAT(a, b) QK__CAT_(a, b)
+#define QK__CAT_(a, b) a##b
+#define QK__NARGS(...)                                                         \
+  QK__NARGS_(__VA_ARGS__, 17, 16, 15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4,  \
+             3, 2, 1, 0)
+#define QK__NARGS_(_1, _2, _3, _4, _5, _6, _7, _8, _9, _10, _11, _12, _13,   \
+                   _14, _15, _16, _17, n, ...)                                 \
+  n
+// 0 for a single argument, 1 for more
+#define QK__HAS_ARGS(...)                                                      \
+  QK__NARGS_(__VA_ARGS__, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 0, \
+             0)
+
+// m(x) for every argument, separated by sep
+#define QK__JOIN(m, sep, ...)                                                  \
+  QK__CAT(QK__JOIN_, QK__NARGS(__VA_ARGS__))(m, sep, __VA_ARGS__)
+#define QK__JOIN_1(m, sep, x) m(x)
+#define QK__JOIN_2(m, sep, x, ...) m(x) sep QK__JOIN_1(m, sep, __VA_ARGS__)
+#define QK__JOIN_3(m, sep, x, ...) m(x) sep QK__JOIN_2(m, sep, __VA_ARGS__)
+#define QK__JOIN_4(m, sep, x, ...) m(x) sep QK__JOIN_3(m, sep, __VA_ARGS__)
+#define QK__JOIN_5(m, sep, x, ...) m(x) sep QK__JOIN_4(m, sep, __VA_ARGS__)
+#define QK__JOIN_6(m, sep, x, ...) m(x) sep QK__JOIN_5(m, sep, __VA_ARGS__)
+#define QK__JOIN_7(m, sep, x, ...) m(x) sep QK__JOIN_6(m, sep, __VA_ARGS__)
+#define QK__JOIN_8(m, sep, x, ...) m(x) sep QK__JOIN_7(m, sep, __VA_ARGS__)
+#define QK__JOIN_9(m, sep, x, ...) m(x) sep QK__JOIN_8(m, sep, __VA_ARGS__)
+#define QK__JOIN_10(m, sep, x, ...) m(x) sep QK__JOIN_9(m, sep, __VA_ARGS__)
+#define QK__JOIN_11(m, sep, x, ...) m(x) sep QK__JOIN_10(m, sep, __VA_ARGS__)
+#define QK__JOIN_12(m, sep, x, ...) m(x) sep QK__JOIN_11(m, sep, __VA_ARGS__)
+#define QK__JOIN_13(m, sep, x, ...) m(x) sep QK__JOIN_12(m, sep, __VA_ARGS__)
+#define QK__JOIN_14(m, sep, x, ...) m(x) sep QK__JOIN_13(m, sep, __VA_ARGS__)
+#define QK__JOIN_15(m, sep, x, ...) m(x) sep QK__JOIN_14(m, sep, __VA_ARGS__)
+#define QK__JOIN_16(m, sep, x, ...) m(x) sep QK__JOIN_15(m, sep, __VA_ARGS__)
 #endif // __QUIRK_H__
 
 #ifdef QUIRK_IMPLEMENTATION
@@ -203,6 +906,8 @@ void qk_map_struct_to_cols_and_values(const void *struct_ptr,
 #define CGHOST_IMPLEMENTATION
 #include "cghost.h"
 
+#include <stdatomic.h>
+
 // === Function definitions ===
 QkSqlQuery qk_sql_select(Str table, Str column) {
   return (QkSqlQuery){
@@ -222,6 +927,48 @@ QkSqlQuery qk_sql_select_many(Str table, StrArr columns) {
   };
 }
 
+// Several fields of a mapping may read the same column, it is selected once
+static void qk_push_column_once(StrArr *columns, StringView name) {
+  for (size_t i = 0; i < columns->count; i += 1) {
+    StringView column = sv_from_str(columns->items[i]);
+    if (sv_equals_icase(&column, &name))
+      return;
+  }
+  da_push(*columns, str_from_sv(name));
+}
+
+QkSqlQuery qk_sql_select_struct(Str table, const QkStructMapping *mapping) {
+  StrArr columns = {0};
+  da_alloc_reserved(columns, mapping->fields.count);
+  for (size_t i = 0; i < mapping->fields.count; i += 1) {
+    qk_push_column_once(&columns, mapping->fields.items[i].column_name);
+  }
+  return qk_sql_select_many(table, columns);
+}
+
+QkSqlQuery qk_sql_select_struct_fields(Str table,
+                                       const QkStructMapping *mapping,
+                                       const char *const *fields,
+                                       size_t count) {
+  StrArr columns = {0};
+  da_alloc_reserved(columns, count);
+  for (size_t i = 0; i < count; i += 1) {
+    StringView name = sv_from_cstr(fields[i]);
+    const QkStructField *field = NULL;
+    for (size_t j = 0; j < mapping->fields.count && NULL == field; j += 1) {
+      if (sv_equals_icase(&mapping->fields.items[j].column_name, &name))
+        field = &mapping->fields.items[j];
+    }
+
+    if (NULL == field) {
+      fprintf(stderr, "[Warning] mapping has no field %s\n", fields[i]);
+      continue;
+    }
+    qk_push_column_once(&columns, field->column_name);
+  }
+  return qk_sql_select_many(table, columns);
+}
+
 QkSqlQuery qk_sql_update(Str table, Str column, QkParam param) {
   return (QkSqlQuery){
       .op = QK_UPDATE,
@@ -279,6 +1026,8 @@ void qk_sql_conflic_resolution(QkSqlQuery *q, QkConflictResolution conflic) {
 void qk_sql_where(QkSqlQuery *q, QkFilter filt, Str column, QkParam param) {
   QkSqlCond c =
       (QkSqlCond){.cv = {.column = column, .param = param}, .filt = filt};
+  if (q->where.capacity == 0)
+    da_alloc_reserved(q->where, QK_WHERE_INIT_CAPACITY);
   da_push(q->where, c);
 }
 
@@ -295,6 +1044,197 @@ void qk_sql_limit(QkSqlQuery *q, int limit) {
   q->limit = limit;
 }
 
+void qk_sql_page(QkSqlQuery *q, StrArr keys, QkOrder order, int page_size) {
+  assert(q->op == QK_SELECT);
+  assert(q->order_by.order == QK_ORDER_NONE && q->page.keys.count == 0);
+  assert(keys.count > 0);
+  assert(order != QK_ORDER_NONE);
+  q->page.keys = keys;
+  q->page.order = order;
+  qk_sql_limit(q, page_size);
+}
+
+// Token layout before hex encoding: value count, then kind and payload of
+// each key value. Integers and doubles take 8 bytes, text and blobs a 4 byte
+// length and the bytes, NULL nothing. Little endian.
+static void qk_token_put(StringBuilder *sb, const void *data, size_t size) {
+  static const char digits[] = "0123456789abcdef";
+  const unsigned char *p = data;
+  for (size_t i = 0; i < size; i += 1) {
+    sb_append_rune(sb, digits[p[i] >> 4]);
+    sb_append_rune(sb, digits[p[i] & 0xf]);
+  }
+}
+
+static void qk_token_put_u64(StringBuilder *sb, uint64_t v) {
+  unsigned char bytes[8];
+  for (size_t i = 0; i < 8; i += 1) {
+    bytes[i] = (unsigned char)(v >> (8 * i));
+  }
+  qk_token_put(sb, bytes, sizeof(bytes));
+}
+
+bool qk_page_token(const QkSqlQuery *q, const QkResultRow *row, Str *out) {
+  if (q->page.keys.count == 0 || q->page.keys.count > UINT8_MAX)
+    return false;
+
+  Str token = str_create(0);
+  StringBuilder *sb = &token.h->b;
+  unsigned char count = (unsigned char)q->page.keys.count;
+  qk_token_put(sb, &count, 1);
+
+  for (size_t k = 0; k < q->page.keys.count; k += 1) {
+    StringView key = sv_from_str(q->page.keys.items[k]);
+    const QkParam *v = NULL;
+    for (size_t i = 0; i < row->columns.count && NULL == v; i += 1) {
+      StringView name = sv_from_str(row->columns.items[i].column_name);
+      if (sv_equals_icase(&name, &key))
+        v = &row->columns.items[i].value;
+    }
+    if (NULL == v) {
+      fprintf(stderr, "[Error] page key %.*s is not selected\n",
+              (int)key.length, key.begin);
+      str_free(&token);
+      return false;
+    }
+
+    unsigned char kind = (unsigned char)v->kind;
+    qk_token_put(sb, &kind, 1);
+    switch (v->kind) {
+    case QK_BOOL:
+    case QK_INT:
+      qk_token_put_u64(sb, (uint64_t)(v->kind == QK_BOOL ? v->as.b : v->as.i));
+      break;
+    case QK_DOUBLE: {
+      uint64_t bits;
+      memcpy(&bits, &v->as.d, sizeof(bits));
+      qk_token_put_u64(sb, bits);
+    } break;
+    case QK_STR:
+    case QK_BLOB: {
+      uint32_t len = (uint32_t)v->as.s.h->b.count;
+      unsigned char bytes[4] = {len, len >> 8, len >> 16, len >> 24};
+      qk_token_put(sb, bytes, sizeof(bytes));
+      qk_token_put(sb, v->as.s.h->b.items, len);
+    } break;
+    case QK_PARAM_NONE:
+    case QK_PARAM_NULL:
+    case QK_ZEROBLOB:
+      break;
+    }
+  }
+
+  *out = token;
+  return true;
+}
+
+typedef struct {
+  StringView hex;
+  bool failed;
+} QkTokenReader;
+
+static int qk_token_digit(char c) {
+  if (c >= '0' && c <= '9')
+    return c - '0';
+  if (c >= 'a' && c <= 'f')
+    return c - 'a' + 10;
+  return -1;
+}
+
+static void qk_token_get(QkTokenReader *r, void *data, size_t size) {
+  unsigned char *p = data;
+  if (r->failed || r->hex.length / 2 < size) {
+    r->failed = true;
+    memset(p, 0, size);
+    return;
+  }
+  for (size_t i = 0; i < size; i += 1) {
+    int hi = qk_token_digit(r->hex.begin[2 * i]);
+    int lo = qk_token_digit(r->hex.begin[2 * i + 1]);
+    r->failed |= hi < 0 || lo < 0;
+    p[i] = (unsigned char)((hi & 0xf) << 4 | (lo & 0xf));
+  }
+  r->hex.begin += 2 * size;
+  r->hex.length -= 2 * size;
+}
+
+static uint64_t qk_token_get_u64(QkTokenReader *r) {
+  unsigned char bytes[8];
+  qk_token_get(r, bytes, sizeof(bytes));
+  uint64_t v = 0;
+  for (size_t i = 0; i < 8; i += 1) {
+    v |= (uint64_t)bytes[i] << (8 * i);
+  }
+  return v;
+}
+
+static void qk_page_after_free(QkSqlQuery *q) {
+  for (size_t i = 0; i < q->page.after.count; i += 1) {
+    if (qk_param_has_str(q->page.after.items[i]))
+      str_free(&q->page.after.items[i].as.s);
+  }
+  q->page.after.count = 0;
+}
+
+bool qk_sql_page_continue(QkSqlQuery *q, StringView token) {
+  QkTokenReader r = {.hex = token};
+  unsigned char count;
+  qk_token_get(&r, &count, 1);
+  if (r.failed || count != q->page.keys.count) {
+    fprintf(stderr, "[Error] page token does not match the query\n");
+    return false;
+  }
+
+  qk_page_after_free(q);
+  for (size_t k = 0; k < count && !r.failed; k += 1) {
+    unsigned char kind;
+    qk_token_get(&r, &kind, 1);
+
+    QkParam v = {.kind = QK_PARAM_NULL};
+    switch ((QkParamKind)kind) {
+    case QK_BOOL:
+      v = qk_bool(qk_token_get_u64(&r) != 0);
+      break;
+    case QK_INT:
+      v = qk_int((int64_t)qk_token_get_u64(&r));
+      break;
+    case QK_DOUBLE: {
+      uint64_t bits = qk_token_get_u64(&r);
+      v.kind = QK_DOUBLE;
+      memcpy(&v.as.d, &bits, sizeof(bits));
+    } break;
+    case QK_STR:
+    case QK_BLOB: {
+      unsigned char bytes[4];
+      qk_token_get(&r, bytes, sizeof(bytes));
+      size_t len = (size_t)bytes[0] | (size_t)bytes[1] << 8 |
+                   (size_t)bytes[2] << 16 | (size_t)bytes[3] << 24;
+      if (r.failed || r.hex.length / 2 < len) {
+        r.failed = true;
+        break;
+      }
+      Str text = str_create(len);
+      text.h->b.count = len;
+      qk_token_get(&r, text.h->b.items, len);
+      v = kind == QK_STR ? qk_str(text) : qk_blob(text);
+    } break;
+    case QK_PARAM_NULL:
+      break;
+    default:
+      r.failed = true;
+      break;
+    }
+    da_push(q->page.after, v);
+  }
+
+  if (r.failed || r.hex.length != 0) {
+    fprintf(stderr, "[Error] malformed page token\n");
+    qk_page_after_free(q);
+    return false;
+  }
+  return true;
+}
+
 static void qk_sql_add_conflic_resolution(QkSqlQuery *q, QkSqlDialect dialect) {
   (void)dialect;
   switch (q->conflic) {
@@ -318,8 +1258,298 @@ static void qk_sql_add_conflic_resolution(QkSqlQuery *q, QkSqlDialect dialect) {
   }
 }
 
+static void qk_sql_add_insert_head(QkSqlQuery *q, QkSqlDialect dialect) {
+  sb_append_cstr(&q->b, "INSERT ");
+  qk_sql_add_conflic_resolution(q, dialect);
+  sb_append_cstr(&q->b, "INTO ");
+  sb_append_str(&q->b, &q->table);
+  sb_append_cstr(&q->b, " (");
+  for (size_t i = 0; i < q->columns.count; i += 1) {
+    if (i > 0) {
+      sb_append_cstr(&q->b, ", ");
+    }
+    sb_append_str(&q->b, &q->columns.items[i]);
+  }
+  sb_append_cstr(&q->b, ") VALUES ");
+}
+
+// Appends rows groups of cols placeholders: (?, ?), (?, ?)
+static void qk_sql_add_values(QkSqlQuery *q, size_t rows, size_t cols) {
+  for (size_t i = 0; i < rows; i += 1) {
+    if (i > 0) {
+      sb_append_cstr(&q->b, ", ");
+    }
+    sb_append_rune(&q->b, '(');
+    for (size_t j = 0; j < cols; j += 1) {
+      if (j > 0) {
+        sb_append_cstr(&q->b, ", ");
+      }
+      sb_append_rune(&q->b, '?');
+    }
+    sb_append_rune(&q->b, ')');
+  }
+}
+
+// FNV-1a, used to key caches on SQL text and query shapes
+static inline uint64_t qk_hash_bytes(const void *data, size_t size,
+                                     uint64_t h) {
+  const unsigned char *p = data;
+  for (size_t i = 0; i < size; i += 1) {
+    h ^= p[i];
+    h *= 0x100000001b3ULL;
+  }
+  return h;
+}
+
+#define QK_HASH_SEED 0xcbf29ce484222325ULL
+
+// FNV-1a over 8 byte words, a word only mixes into the bits above it until
+// qk_hash_finish spreads them
+static inline uint64_t qk_hash_words(const void *data, size_t size,
+                                     uint64_t h) {
+  const unsigned char *p = data;
+  for (; size >= sizeof(uint64_t); size -= sizeof(uint64_t)) {
+    uint64_t word;
+    memcpy(&word, p, sizeof(word));
+    h ^= word;
+    h *= 0x100000001b3ULL;
+    p += sizeof(word);
+  }
+  return qk_hash_bytes(p, size, h);
+}
+
+static inline uint64_t qk_hash_finish(uint64_t h) {
+  h ^= h >> 33;
+  h *= 0xff51afd7ed558ccdULL;
+  h ^= h >> 33;
+  return h;
+}
+
+// A walk over the shape of a query hashes it, compares it with the copy kept
+// in a cache entry or writes that copy, without building it first
+typedef enum {
+  QK_SHAPE_HASH,
+  QK_SHAPE_COMPARE,
+  QK_SHAPE_WRITE,
+} QkShapeMode;
+
+typedef struct {
+  QkShapeMode mode;
+  uint64_t hash;
+  char *key; // the stored shape, compared with or written to
+  size_t key_len;
+  size_t len; // bytes walked so far
+  bool differs;
+} QkShapeWalk;
+
+static inline void qk_shape_put(QkShapeWalk *w, const void *data,
+                                size_t size) {
+  switch (w->mode) {
+  case QK_SHAPE_HASH:
+    w->hash = qk_hash_words(data, size, w->hash);
+    break;
+  case QK_SHAPE_COMPARE:
+    if (!w->differs && (w->len + size > w->key_len ||
+                        0 != memcmp(w->key + w->len, data, size)))
+      w->differs = true;
+    break;
+  case QK_SHAPE_WRITE:
+    memcpy(w->key + w->len, data, size);
+    break;
+  }
+  w->len += size;
+}
+
+#define qk_shape_put_value(w, v) qk_shape_put((w), &(v), sizeof(v))
+
+// Length first, so that neighbouring strings can not shift into each other
+static inline void qk_shape_put_str(QkShapeWalk *w, Str s) {
+  size_t len = NULL == s.h ? 0 : s.h->b.count;
+  qk_shape_put_value(w, len);
+  if (len > 0)
+    qk_shape_put(w, s.h->b.items, len);
+}
+
+// Everything the rendered SQL depends on, parameter values excluded
+static void qk_sql_shape_walk(const QkSqlQuery *q, QkSqlDialect dialect,
+                              QkShapeWalk *w) {
+  qk_shape_put_value(w, dialect);
+  qk_shape_put_value(w, q->op);
+  qk_shape_put_value(w, q->conflic);
+  qk_shape_put_str(w, q->table);
+
+  if (q->op == QK_INSERT) {
+    size_t rows = q->param_rows.count;
+    size_t cols = q->param_rows.items[0].count;
+    qk_shape_put_value(w, rows);
+    qk_shape_put_value(w, cols);
+  }
+  qk_shape_put_value(w, q->columns.count);
+  for (size_t i = 0; i < q->columns.count; i += 1) {
+    qk_shape_put_str(w, q->columns.items[i]);
+  }
+
+  qk_shape_put_value(w, q->where.count);
+  for (size_t i = 0; i < q->where.count; i += 1) {
+    qk_shape_put_str(w, q->where.items[i].cv.column);
+    qk_shape_put_value(w, q->where.items[i].filt);
+  }
+
+  qk_shape_put_value(w, q->order_by.order);
+  if (q->order_by.order != QK_ORDER_NONE)
+    qk_shape_put_str(w, q->order_by.column);
+
+  qk_shape_put_value(w, q->page.keys.count);
+  for (size_t i = 0; i < q->page.keys.count; i += 1) {
+    qk_shape_put_str(w, q->page.keys.items[i]);
+  }
+  qk_shape_put_value(w, q->page.order);
+  qk_shape_put_value(w, q->page.after.count);
+  qk_shape_put_value(w, q->limit);
+}
+
+// Process-wide cache of rendered SQL keyed on the query shape. An entry is
+// published once into an empty slot and never changed afterwards, so lookups
+// do not lock. A shape probes QK_SHAPE_CACHE_PROBES slots, when they all hold
+// other shapes it is rendered on every build. Entries are allocated with
+// std_allocator since they are shared between threads.
+typedef struct {
+  uint64_t hash;
+  size_t key_len;
+  size_t sql_len; // includes the NUL
+  char data[];    // key_len bytes of shape followed by the SQL
+} QkShapeCacheEntry;
+
+static _Atomic(QkShapeCacheEntry *) qk_shape_cache[QK_SHAPE_CACHE_SIZE];
+
+static bool qk_shape_cache_matches(const QkShapeCacheEntry *e,
+                                   const QkSqlQuery *q, QkSqlDialect dialect,
+                                   uint64_t hash, size_t key_len) {
+  if (e->hash != hash || e->key_len != key_len)
+    return false;
+  QkShapeWalk w = {
+      .mode = QK_SHAPE_COMPARE,
+      .key = (char *)e->data,
+      .key_len = e->key_len,
+  };
+  qk_sql_shape_walk(q, dialect, &w);
+  return !w.differs;
+}
+
+// On a hit q->b is replaced by the cached SQL
+static bool qk_shape_cache_get(QkSqlQuery *q, QkSqlDialect dialect,
+                               uint64_t hash, size_t key_len) {
+  for (size_t i = 0; i < QK_SHAPE_CACHE_PROBES; i += 1) {
+    QkShapeCacheEntry *e =
+        atomic_load_explicit(&qk_shape_cache[(hash + i) % QK_SHAPE_CACHE_SIZE],
+                             memory_order_acquire);
+    // slots are taken in probe order and never emptied while building
+    if (NULL == e)
+      return false;
+    if (!qk_shape_cache_matches(e, q, dialect, hash, key_len))
+      continue;
+
+    sb_expand_buffer(q->b, e->sql_len);
+    memcpy(q->b.items, e->data + e->key_len, e->sql_len);
+    q->b.count = e->sql_len;
+    return true;
+  }
+  return false;
+}
+
+// q->b holds the rendered SQL
+static void qk_shape_cache_put(const QkSqlQuery *q, QkSqlDialect dialect,
+                               uint64_t hash, size_t key_len) {
+  QkShapeCacheEntry *e =
+      std_malloc(NULL, sizeof(QkShapeCacheEntry) + key_len + q->b.count);
+  if (NULL == e)
+    return;
+  e->hash = hash;
+  e->key_len = key_len;
+  e->sql_len = q->b.count;
+  QkShapeWalk w = {.mode = QK_SHAPE_WRITE, .key = e->data};
+  qk_sql_shape_walk(q, dialect, &w);
+  memcpy(e->data + key_len, q->b.items, q->b.count);
+
+  for (size_t i = 0; i < QK_SHAPE_CACHE_PROBES; i += 1) {
+    _Atomic(QkShapeCacheEntry *) *slot =
+        &qk_shape_cache[(hash + i) % QK_SHAPE_CACHE_SIZE];
+    QkShapeCacheEntry *cur = NULL;
+    if (atomic_compare_exchange_strong_explicit(
+            slot, &cur, e, memory_order_release, memory_order_acquire))
+      return;
+    // another thread may have published the same shape first
+    if (qk_shape_cache_matches(cur, q, dialect, hash, key_len))
+      break;
+  }
+  std_free(NULL, e);
+}
+
+void qk_shape_cache_clear(void) {
+  for (size_t i = 0; i < QK_SHAPE_CACHE_SIZE; i += 1) {
+    std_free(NULL, atomic_exchange(&qk_shape_cache[i], NULL));
+  }
+}
+
+// Checks that the parameters fit the query, the shape only looks at the first
+// row of an insert
+static bool qk_sql_check(const QkSqlQuery *q) {
+  switch (q->op) {
+  case QK_SELECT:
+    if (q->columns.count == 0) {
+      fprintf(stderr, "[Error] SELECT without columns\n");
+      return false;
+    }
+    break;
+  case QK_UPDATE:
+    return q->param_rows.count == 1 &&
+           q->columns.count == q->param_rows.items[0].count;
+  case QK_INSERT: {
+    if (q->param_rows.count == 0)
+      return false;
+    size_t cols = q->param_rows.items[0].count;
+    for (size_t i = 0; i < q->param_rows.count; i += 1) {
+      if (cols != q->param_rows.items[i].count)
+        return false;
+    }
+  } break;
+  default:
+    break;
+  }
+  return q->page.after.count == 0 ||
+         q->page.after.count == q->page.keys.count;
+}
+
+// (k1, k2) > (?, ?), descending pages compare with <
+static void qk_sql_add_seek(QkSqlQuery *q) {
+  size_t n = q->page.keys.count;
+  if (n > 1)
+    sb_append_rune(&q->b, '(');
+  for (size_t i = 0; i < n; i += 1) {
+    if (i > 0)
+      sb_append_cstr(&q->b, ", ");
+    sb_append_str(&q->b, &q->page.keys.items[i]);
+  }
+  sb_append_cstr(&q->b, n > 1 ? ")" : "");
+  sb_append_cstr(&q->b, q->page.order == QK_DESC ? " < " : " > ");
+  sb_append_cstr(&q->b, n > 1 ? "(" : "");
+  for (size_t i = 0; i < n; i += 1) {
+    sb_append_cstr(&q->b, i > 0 ? ", ?" : "?");
+  }
+  if (n > 1)
+    sb_append_rune(&q->b, ')');
+}
+
 bool qk_sql_build(QkSqlQuery *q, QkSqlDialect dialect) {
   q->b.count = 0;
+  if (!qk_sql_check(q))
+    return false;
+
+  QkShapeWalk shape = {.mode = QK_SHAPE_HASH, .hash = QK_HASH_SEED};
+  qk_sql_shape_walk(q, dialect, &shape);
+  shape.hash = qk_hash_finish(shape.hash);
+  if (qk_shape_cache_get(q, dialect, shape.hash, shape.len))
+    return true;
 
   switch (q->op) {
   case QK_SELECT: {
@@ -339,50 +1569,19 @@ bool qk_sql_build(QkSqlQuery *q, QkSqlDialect dialect) {
     qk_sql_add_conflic_resolution(q, dialect);
     sb_append_str(&q->b, &q->table);
     sb_append_cstr(&q->b, " SET ");
-    if (q->param_rows.count != 1 ||
-        q->columns.count != q->param_rows.items[0].count)
-      return false;
     for (size_t i = 0; i < q->columns.count; i += 1) {
       if (i > 0)
         sb_append_cstr(&q->b, ", ");
-      sb_appendf(&q->b, "%.*s = ?", str_expand(q->columns.items[0]));
+      sb_appendf(&q->b, "%.*s = ?", str_expand(q->columns.items[i]));
     }
   } break;
 
   case QK_INSERT: {
-    sb_append_cstr(&q->b, "INSERT ");
-    qk_sql_add_conflic_resolution(q, dialect);
-    sb_append_cstr(&q->b, "INTO ");
-    sb_append_str(&q->b, &q->table);
-    sb_append_cstr(&q->b, " (");
-    for (size_t i = 0; i < q->columns.count; i += 1) {
-      if (i > 0) {
-        sb_append_cstr(&q->b, ", ");
-      }
-      sb_append_str(&q->b, &q->columns.items[i]);
-    }
-    sb_append_cstr(&q->b, ") VALUES ");
-    if (q->param_rows.count == 0)
-      return false;
-    size_t cols = q->param_rows.items[0].count;
-    for (size_t i = 0; i < q->param_rows.count; i += 1) {
-      if (i > 0) {
-        sb_append_cstr(&q->b, ", ");
-      }
-      sb_append_rune(&q->b, '(');
-      for (size_t j = 0; j < q->param_rows.items[i].count; j += 1) {
-        if (cols != q->param_rows.items[i].count)
-          return false;
-        if (j > 0) {
-          sb_append_cstr(&q->b, ", ");
-        }
-        sb_append_rune(&q->b, '?');
-      }
-      sb_append_rune(&q->b, ')');
-    }
+    qk_sql_add_insert_head(q, dialect);
+    qk_sql_add_values(q, q->param_rows.count, q->param_rows.items[0].count);
   } break;
   case QK_DELETE:
-    sb_append_cstr(&q->b, "DELETE");
+    sb_append_cstr(&q->b, "DELETE ");
     qk_sql_add_conflic_resolution(q, dialect);
     sb_appendf(&q->b, "FROM %.*s", str_expand(q->table));
     break;
@@ -426,7 +1625,20 @@ bool qk_sql_build(QkSqlQuery *q, QkSqlDialect dialect) {
     }
   }
 
-  if (q->order_by.order != QK_ORDER_NONE) {
+  if (q->page.after.count > 0) {
+    sb_append_cstr(&q->b, q->where.count > 0 ? " AND " : " WHERE ");
+    qk_sql_add_seek(q);
+  }
+
+  if (q->page.keys.count > 0) {
+    sb_append_cstr(&q->b, " ORDER BY ");
+    for (size_t i = 0; i < q->page.keys.count; i += 1) {
+      if (i > 0)
+        sb_append_cstr(&q->b, ", ");
+      sb_append_str(&q->b, &q->page.keys.items[i]);
+      sb_append_cstr(&q->b, q->page.order == QK_ASC ? " ASC" : " DESC");
+    }
+  } else if (q->order_by.order != QK_ORDER_NONE) {
     sb_append_cstr(&q->b, " ORDER BY ");
     sb_append_string_view(&q->b, &sv_from_str(q->order_by.column));
     if (q->order_by.order == QK_ASC)
@@ -435,141 +1647,1756 @@ bool qk_sql_build(QkSqlQuery *q, QkSqlDialect dialect) {
       sb_append_cstr(&q->b, " DESC");
   }
 
-  if (q->limit >= 0)
-    sb_appendf(&q->b, " LIMIT %d", q->limit);
+  if (q->limit >= 0)
+    sb_appendf(&q->b, " LIMIT %d", q->limit);
+
+  sb_append_rune(&q->b, '\0');
+  qk_shape_cache_put(q, dialect, shape.hash, shape.len);
+  return true;
+}
+
+static QkTraceHook qk_trace_hook = {0};
+static pthread_mutex_t qk_trace_lock = PTHREAD_MUTEX_INITIALIZER;
+static atomic_bool qk_trace_hook_set = false;
+
+void qk_set_trace_hook(QkTraceFn fn, void *user_data) {
+  pthread_mutex_lock(&qk_trace_lock);
+  qk_trace_hook = (QkTraceHook){.fn = fn, .user_data = user_data};
+  atomic_store_explicit(&qk_trace_hook_set, NULL != fn, memory_order_release);
+  pthread_mutex_unlock(&qk_trace_lock);
+}
+
+// fn and user_data are read together, a hook set concurrently is never seen
+// half updated. Without a hook the only cost is one atomic load.
+static QkTraceHook qk_trace_hook_load(void) {
+  if (!atomic_load_explicit(&qk_trace_hook_set, memory_order_acquire))
+    return (QkTraceHook){0};
+  pthread_mutex_lock(&qk_trace_lock);
+  QkTraceHook hook = qk_trace_hook;
+  pthread_mutex_unlock(&qk_trace_lock);
+  return hook;
+}
+
+static uint64_t qk_now_ns(void) {
+  struct timespec ts;
+  timespec_get(&ts, TIME_UTC);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+static inline void qk_trace_begin(QkTrace *t, QkOp op) {
+  t->hook = qk_trace_hook_load();
+  t->on = NULL != t->hook.fn;
+  t->ev = (QkTraceEvent){.op = op};
+  if (t->on)
+    t->t = qk_now_ns();
+}
+
+// Adds the time since the previous lap to *phase
+static inline void qk_trace_lap(QkTrace *t, uint64_t *phase) {
+  if (t->on) {
+    uint64_t now = qk_now_ns();
+    *phase += now - t->t;
+    t->t = now;
+  }
+}
+
+static void qk_trace_report(const QkTraceHook *hook, QkTraceEvent *ev,
+                            const char *sql, bool ok) {
+  if (NULL == hook->fn)
+    return;
+  ev->sql = sql;
+  ev->ok = ok;
+  hook->fn(ev, hook->user_data);
+}
+
+static inline void qk_trace_end(QkTrace *t, sqlite3 *db, const char *sql,
+                                bool ok) {
+  if (!t->on)
+    return;
+  if (!t->ev.raw && t->ev.op != QK_SELECT && ok)
+    t->ev.rows_changed = (size_t)sqlite3_changes(db);
+  qk_trace_report(&t->hook, &t->ev, sql, ok);
+}
+
+bool qk_bind_param_sqlite(sqlite3_stmt *stmt, int idx, QkParam *p) {
+  return qk_bind_param_sqlite_mode(stmt, idx, p, QK_BIND_TRANSIENT);
+}
+
+bool qk_bind_param_sqlite_mode(sqlite3_stmt *stmt, int idx, QkParam *p,
+                               QkBindMode mode) {
+  switch (p->kind) {
+  case QK_PARAM_NONE:
+    fprintf(stderr, "[Error] QK_PARAM_NONE should not be passed to query\n");
+    return false;
+  case QK_PARAM_NULL:
+    sqlite3_bind_null(stmt, idx);
+    break;
+  case QK_BOOL:
+    sqlite3_bind_int(stmt, idx, p->as.b);
+    break;
+  case QK_INT:
+    sqlite3_bind_int64(stmt, idx, p->as.i);
+    break;
+  case QK_DOUBLE:
+    sqlite3_bind_double(stmt, idx, p->as.d);
+    break;
+  case QK_STR:
+    sqlite3_bind_text(stmt, idx, p->as.s.h->b.items, (int)p->as.s.h->b.count,
+                      mode == QK_BIND_STATIC ? SQLITE_STATIC
+                                             : SQLITE_TRANSIENT);
+    break;
+  case QK_BLOB:
+    sqlite3_bind_blob(stmt, idx, p->as.s.h->b.items, (int)p->as.s.h->b.count,
+                      mode == QK_BIND_STATIC ? SQLITE_STATIC
+                                             : SQLITE_TRANSIENT);
+    break;
+  case QK_ZEROBLOB:
+    sqlite3_bind_zeroblob64(stmt, idx, (sqlite3_uint64)p->as.i);
+    break;
+  }
+
+  return true;
+}
+
+static size_t qk_bind_params(QkSqlQuery *q, sqlite3_stmt *stmt, size_t offset) {
+  size_t rows = q->param_rows.count;
+  size_t cols = q->param_rows.items[0].count;
+
+  for (size_t i = 0; i < rows; i += 1) {
+    for (size_t j = 0; j < cols; j += 1) {
+      size_t idx = offset + 1 + (i * cols + j);
+      qk_bind_param_sqlite_mode(stmt, idx, &q->param_rows.items[i].items[j],
+                                QK_BIND_STATIC);
+    }
+  }
+
+  return rows * cols;
+}
+
+static size_t qk_bind_where(QkSqlQuery *q, sqlite3_stmt *stmt, size_t offset) {
+  for (int i = 0; i < (int)q->where.count; ++i) {
+    qk_bind_param_sqlite_mode(stmt, offset + i + 1,
+                              &q->where.items[i].cv.param, QK_BIND_STATIC);
+  }
+  return q->where.count;
+}
+
+static size_t qk_bind_page(QkSqlQuery *q, sqlite3_stmt *stmt, size_t offset) {
+  for (size_t i = 0; i < q->page.after.count; i += 1) {
+    qk_bind_param_sqlite_mode(stmt, offset + i + 1, &q->page.after.items[i],
+                              QK_BIND_STATIC);
+  }
+  return q->page.after.count;
+}
+
+static void qk_sql_bind_sqlite(QkSqlQuery *q, sqlite3_stmt *stmt) {
+  switch (q->op) {
+  case QK_SELECT:
+    qk_bind_page(q, stmt, qk_bind_where(q, stmt, 0));
+    break;
+
+  case QK_DELETE:
+    qk_bind_where(q, stmt, 0);
+    break;
+
+  case QK_INSERT:
+    qk_bind_params(q, stmt, 0);
+    break;
+
+  case QK_UPDATE: {
+    size_t offset = qk_bind_params(q, stmt, 0);
+    qk_bind_where(q, stmt, offset);
+  } break;
+  }
+}
+
+// Column names are created once per statement, rows hold references to them
+static size_t qk_column_names(sqlite3_stmt *stmt, StrArr *names) {
+  int col_count = sqlite3_column_count(stmt);
+  size_t bytes = col_count * sizeof(Str);
+
+  da_alloc_reserved(*names, (size_t)col_count);
+  for (int i = 0; i < col_count; ++i) {
+    Str name = str_from_cstr(sqlite3_column_name(stmt, i));
+    bytes += sizeof(CowStrHeader) + name.h->b.capacity;
+    da_push(*names, name);
+  }
+  return bytes;
+}
+
+// Appends the columns of the current row of stmt to row, returns the number
+// of bytes materialized
+static size_t qk_row_from_stmt(sqlite3_stmt *stmt, StrArr *names,
+                               QkResultRow *row) {
+  int col_count = sqlite3_column_count(stmt);
+  size_t bytes = col_count * sizeof(QkResultColumn);
+
+  if (row->columns.capacity < (size_t)col_count)
+    da_resize(row->columns, (size_t)col_count);
+
+  for (int i = 0; i < col_count; ++i) {
+    int type = sqlite3_column_type(stmt, i);
+
+    QkResultColumn col = {
+        .column_name = str_clone(&names->items[i]),
+    };
+
+    switch (type) {
+    case SQLITE_INTEGER:
+      col.value = qk_int(sqlite3_column_int64(stmt, i));
+      break;
+    case SQLITE_FLOAT:
+      col.value = qk_double(sqlite3_column_double(stmt, i));
+      break;
+    case SQLITE_TEXT: {
+      Str text = str_from_cstr((const char *)sqlite3_column_text(stmt, i));
+      bytes += text.h->b.count;
+      col.value = qk_str(text);
+      break;
+    }
+    case SQLITE_BLOB: {
+      const void *blob = sqlite3_column_blob(stmt, i);
+      size_t len = (size_t)sqlite3_column_bytes(stmt, i);
+      bytes += len;
+      col.value = qk_blob_from(blob, len);
+      break;
+    }
+    case SQLITE_NULL:
+      col.value.kind = QK_PARAM_NULL;
+      break;
+    default:
+      fprintf(stderr, "Unsupported SQLite column type\n");
+      break;
+    }
+
+    da_push(row->columns, col);
+  }
+
+  return bytes;
+}
+
+// Frees the values of row but keeps its storage for the next row
+static void qk_result_row_clear(QkResultRow *row) {
+  for (size_t j = 0; j < row->columns.count; j += 1) {
+    QkResultColumn *col = &row->columns.items[j];
+    str_free(&col->column_name);
+    if (qk_param_has_str(col->value)) {
+      str_free(&col->value.as.s);
+    }
+  }
+  row->columns.count = 0;
+}
+
+static bool qk_sql_step_sqlite(sqlite3 *db, sqlite3_stmt *stmt,
+                               QkResultSet *out, QkTraceEvent *ev) {
+  if (out != NULL)
+    CG_ALLOCATOR_PUSH(arena_create_allocator(&out->arena));
+
+  // Execute and collect rows
+  StrArr names = {0}; // in the arena with the rows
+  bool ok = true;
+  while (true) {
+    int rc = sqlite3_step(stmt);
+    if (rc == SQLITE_DONE)
+      break;
+    else if (rc != SQLITE_ROW) {
+      printf("[Error] sqlite3 step failed: %s\n", sqlite3_errmsg(db));
+      ok = false;
+      break;
+    }
+
+    ev->rows_returned += 1;
+    if (out != NULL) {
+      if (NULL == names.items)
+        ev->bytes_materialized += qk_column_names(stmt, &names);
+      QkResultRow row = {0};
+      ev->bytes_materialized +=
+          sizeof(row) + qk_row_from_stmt(stmt, &names, &row);
+      da_push(out->rows, row);
+    }
+  }
+
+  if (out != NULL)
+    CG_ALLOCATOR_POP();
+  return ok;
+}
+
+bool qk_sql_exec_sqlite(QkSqlQuery *q, sqlite3 *db, QkResultSet *out) {
+  if (!qk_sql_build(q, QK_SQL_DIALECT_SQLITE))
+    return false;
+
+  const char *sql = sb_get_cstr(&q->b);
+
+  QkTrace t;
+  qk_trace_begin(&t, q->op);
+
+  sqlite3_stmt *stmt = NULL;
+  if (sqlite3_prepare_v2(db, sql, -1, &stmt, NULL) != SQLITE_OK) {
+    fprintf(stderr, "SQL prepare error: %s\n", sqlite3_errmsg(db));
+    qk_trace_end(&t, db, sql, false);
+    return false;
+  }
+  qk_trace_lap(&t, &t.ev.prepare_ns);
+
+  qk_sql_bind_sqlite(q, stmt);
+  qk_trace_lap(&t, &t.ev.bind_ns);
+
+  bool ok = qk_sql_step_sqlite(db, stmt, out, &t.ev);
+  qk_trace_lap(&t, &t.ev.step_ns);
+  qk_trace_end(&t, db, sql, ok);
+
+  sqlite3_finalize(stmt);
+  return ok;
+}
+
+void qk_conn_init(QkConn *c, sqlite3 *db, size_t stmt_cache_capacity) {
+  *c = (QkConn){
+      .db = db,
+      .stmts.capacity = stmt_cache_capacity,
+  };
+  if (stmt_cache_capacity > 0)
+    da_alloc_reserved(c->stmts.entries, stmt_cache_capacity);
+}
+
+void qk_conn_free(QkConn *c) {
+  if (NULL == c)
+    return;
+
+  for (size_t i = 0; i < c->stmts.entries.count; i += 1) {
+    sqlite3_finalize(c->stmts.entries.items[i].stmt);
+  }
+  da_free(c->stmts.entries);
+
+  memset(c, 0, sizeof(*c));
+}
+
+sqlite3_stmt *qk_conn_prepare(QkConn *c, const char *sql) {
+  QkStmtCache *cache = &c->stmts;
+  size_t len = strlen(sql);
+  uint64_t hash = qk_hash_bytes(sql, len, QK_HASH_SEED);
+  cache->tick += 1;
+
+  for (size_t i = 0; i < cache->entries.count; i += 1) {
+    QkStmtCacheEntry *e = &cache->entries.items[i];
+    if (e->hash == hash && !e->in_use &&
+        0 == strcmp(sqlite3_sql(e->stmt), sql)) {
+      e->in_use = true;
+      e->last_used = cache->tick;
+      cache->hits += 1;
+      return e->stmt;
+    }
+  }
+
+  cache->misses += 1;
+
+  sqlite3_stmt *stmt = NULL;
+  if (sqlite3_prepare_v3(c->db, sql, (int)len + 1, SQLITE_PREPARE_PERSISTENT,
+                         &stmt, NULL) != SQLITE_OK) {
+    fprintf(stderr, "SQL prepare error: %s\n", sqlite3_errmsg(c->db));
+    return NULL;
+  }
+
+  if (cache->capacity == 0)
+    return stmt;
+
+  QkStmtCacheEntry entry = {
+      .hash = hash,
+      .last_used = cache->tick,
+      .stmt = stmt,
+      .in_use = true,
+  };
+
+  if (cache->entries.count < cache->capacity) {
+    da_push(cache->entries, entry);
+    return stmt;
+  }
+
+  // evict the least recently used statement that is not checked out
+  QkStmtCacheEntry *victim = NULL;
+  for (size_t i = 0; i < cache->entries.count; i += 1) {
+    QkStmtCacheEntry *e = &cache->entries.items[i];
+    if (!e->in_use && (NULL == victim || e->last_used < victim->last_used))
+      victim = e;
+  }
+
+  // every cached statement is in use, so this one stays uncached
+  if (NULL == victim)
+    return stmt;
+
+  sqlite3_finalize(victim->stmt);
+  *victim = entry;
+  cache->evictions += 1;
+  return stmt;
+}
+
+void qk_conn_release(QkConn *c, sqlite3_stmt *stmt) {
+  if (NULL == stmt)
+    return;
+
+  for (size_t i = 0; i < c->stmts.entries.count; i += 1) {
+    QkStmtCacheEntry *e = &c->stmts.entries.items[i];
+    if (e->stmt == stmt) {
+      sqlite3_reset(stmt);
+      sqlite3_clear_bindings(stmt);
+      e->in_use = false;
+      return;
+    }
+  }
+
+  sqlite3_finalize(stmt);
+}
+
+// Checks the statement for sql out of the cache and records it in t
+static sqlite3_stmt *qk_conn_prepare_traced(QkConn *c, const char *sql,
+                                            QkTrace *t) {
+  size_t hits = c->stmts.hits;
+  sqlite3_stmt *stmt = qk_conn_prepare(c, sql);
+  t->ev.cached = hits != c->stmts.hits;
+  qk_trace_lap(t, &t->ev.prepare_ns);
+  if (NULL == stmt)
+    qk_trace_end(t, c->db, sql, false);
+  return stmt;
+}
+
+// Executes q that is already built
+static bool qk_conn_exec_built(QkConn *c, QkSqlQuery *q, QkResultSet *out) {
+  const char *sql = sb_get_cstr(&q->b);
+
+  QkTrace t;
+  qk_trace_begin(&t, q->op);
+
+  sqlite3_stmt *stmt = qk_conn_prepare_traced(c, sql, &t);
+  if (NULL == stmt)
+    return false;
+
+  qk_sql_bind_sqlite(q, stmt);
+  qk_trace_lap(&t, &t.ev.bind_ns);
+
+  bool ok = qk_sql_step_sqlite(c->db, stmt, out, &t.ev);
+  qk_trace_lap(&t, &t.ev.step_ns);
+  qk_trace_end(&t, c->db, sql, ok);
+
+  qk_conn_release(c, stmt);
+  return ok;
+}
+
+bool qk_conn_exec(QkConn *c, QkSqlQuery *q, QkResultSet *out) {
+  if (!qk_sql_build(q, QK_SQL_DIALECT_SQLITE))
+    return false;
+  return qk_conn_exec_built(c, q, out);
+}
+
+// Static SQL always starts with the statement keyword
+static QkOp qk_static_op(const char *sql) {
+  switch (sql[0]) {
+  case 'U':
+    return QK_UPDATE;
+  case 'I':
+    return QK_INSERT;
+  case 'D':
+    return QK_DELETE;
+  default:
+    return QK_SELECT;
+  }
+}
+
+sqlite3_stmt *qk_static_prepare(QkConn *c, const char *sql, QkTrace *t) {
+  qk_trace_begin(t, qk_static_op(sql));
+  return qk_conn_prepare_traced(c, sql, t);
+}
+
+bool qk_static_exec(QkConn *c, sqlite3_stmt *stmt, bool bound,
+                    QkResultSet *out, QkTrace *t) {
+  qk_trace_lap(t, &t->ev.bind_ns);
+
+  bool ok = false;
+  if (bound)
+    ok = qk_sql_step_sqlite(c->db, stmt, out, &t->ev);
+  else
+    fprintf(stderr, "[Error] sqlite3 bind failed: %s\n",
+            sqlite3_errmsg(c->db));
+  qk_trace_lap(t, &t->ev.step_ns);
+  qk_trace_end(t, c->db, sqlite3_sql(stmt), ok);
+
+  qk_conn_release(c, stmt);
+  return ok;
+}
+
+bool qk_static_bind_bool(sqlite3_stmt *stmt, int i, bool v) {
+  return SQLITE_OK == sqlite3_bind_int(stmt, i, v);
+}
+
+bool qk_static_bind_int(sqlite3_stmt *stmt, int i, int v) {
+  return SQLITE_OK == sqlite3_bind_int(stmt, i, v);
+}
+
+bool qk_static_bind_int64(sqlite3_stmt *stmt, int i, int64_t v) {
+  return SQLITE_OK == sqlite3_bind_int64(stmt, i, v);
+}
+
+bool qk_static_bind_double(sqlite3_stmt *stmt, int i, double v) {
+  return SQLITE_OK == sqlite3_bind_double(stmt, i, v);
+}
+
+bool qk_static_bind_text(sqlite3_stmt *stmt, int i, const char *v) {
+  if (NULL == v)
+    return SQLITE_OK == sqlite3_bind_null(stmt, i);
+  return SQLITE_OK == sqlite3_bind_text(stmt, i, v, -1, SQLITE_STATIC);
+}
+
+bool qk_static_bind_sv(sqlite3_stmt *stmt, int i, StringView v) {
+  return SQLITE_OK ==
+         sqlite3_bind_text(stmt, i, v.begin, (int)v.length, SQLITE_STATIC);
+}
+
+bool qk_static_bind_str(sqlite3_stmt *stmt, int i, Str v) {
+  if (NULL == v.h)
+    return SQLITE_OK == sqlite3_bind_null(stmt, i);
+  return qk_static_bind_sv(stmt, i, sv_from_str(v));
+}
+
+// Runs a statement without parameters and results through the cache
+static bool qk_conn_exec_sql(QkConn *c, const char *sql) {
+  QkTrace t;
+  qk_trace_begin(&t, QK_SELECT);
+  t.ev.raw = true;
+
+  sqlite3_stmt *stmt = qk_conn_prepare_traced(c, sql, &t);
+  if (NULL == stmt)
+    return false;
+
+  int rc = sqlite3_step(stmt);
+  if (rc != SQLITE_DONE)
+    fprintf(stderr, "[Error] %s failed: %s\n", sql, sqlite3_errmsg(c->db));
+  qk_trace_lap(&t, &t.ev.step_ns);
+  qk_trace_end(&t, c->db, sql, rc == SQLITE_DONE);
+
+  qk_conn_release(c, stmt);
+  return rc == SQLITE_DONE;
+}
+
+static bool qk_conn_savepoint(QkConn *c, const char *verb, size_t level) {
+  char sql[64];
+  snprintf(sql, sizeof(sql), "%s qk_sp_%zu", verb, level);
+  return qk_conn_exec_sql(c, sql);
+}
+
+bool qk_conn_begin(QkConn *c, QkTxMode mode) {
+  if (c->tx_depth == 0 && sqlite3_get_autocommit(c->db)) {
+    const char *sql = "BEGIN DEFERRED";
+    switch (mode) {
+    case QK_TX_DEFERRED:
+      break;
+    case QK_TX_IMMEDIATE:
+      sql = "BEGIN IMMEDIATE";
+      break;
+    case QK_TX_EXCLUSIVE:
+      sql = "BEGIN EXCLUSIVE";
+      break;
+    }
+    if (!qk_conn_exec_sql(c, sql))
+      return false;
+    c->tx_root_savepoint = false;
+  } else {
+    if (!qk_conn_savepoint(c, "SAVEPOINT", c->tx_depth))
+      return false;
+    if (c->tx_depth == 0)
+      c->tx_root_savepoint = true;
+  }
+
+  c->tx_depth += 1;
+  return true;
+}
+
+bool qk_conn_commit(QkConn *c) {
+  assert(c->tx_depth > 0 && "qk_conn_commit without qk_conn_begin");
+
+  size_t level = c->tx_depth - 1;
+  bool ok = level == 0 && !c->tx_root_savepoint
+                ? qk_conn_exec_sql(c, "COMMIT")
+                : qk_conn_savepoint(c, "RELEASE", level);
+  if (ok)
+    c->tx_depth = level;
+  return ok;
+}
+
+bool qk_conn_rollback(QkConn *c) {
+  assert(c->tx_depth > 0 && "qk_conn_rollback without qk_conn_begin");
+
+  size_t level = c->tx_depth - 1;
+  c->tx_depth = level;
+  if (level == 0 && !c->tx_root_savepoint)
+    return qk_conn_exec_sql(c, "ROLLBACK");
+
+  // ROLLBACK TO keeps the savepoint open, release it as well
+  bool ok = qk_conn_savepoint(c, "ROLLBACK TO", level);
+  return qk_conn_savepoint(c, "RELEASE", level) && ok;
+}
+
+// Opens a connection meant to be used by one thread at a time next to other
+// connections to the same file
+static sqlite3 *qk_open_shared(const char *path, bool enable_wal) {
+  int flags = SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE | SQLITE_OPEN_NOMUTEX;
+  sqlite3 *db = NULL;
+  if (sqlite3_open_v2(path, &db, flags, NULL) != SQLITE_OK) {
+    fprintf(stderr, "[Error] Could not open '%s': %s\n", path,
+            sqlite3_errmsg(db));
+    sqlite3_close(db);
+    return NULL;
+  }
+  sqlite3_busy_timeout(db, QK_POOL_BUSY_TIMEOUT_MS);
+
+  if (enable_wal &&
+      sqlite3_exec(db, "PRAGMA journal_mode=WAL", NULL, NULL, NULL) !=
+          SQLITE_OK) {
+    fprintf(stderr, "[Error] Could not enable WAL: %s\n", sqlite3_errmsg(db));
+    sqlite3_close(db);
+    return NULL;
+  }
+  return db;
+}
+
+bool qk_pool_open(QkPool *p, const char *path, size_t size,
+                  size_t stmt_cache_capacity) {
+  assert(size > 0);
+  *p = (QkPool){0};
+  p->entries = CG_CALLOC(CG_ALLOCATOR_INSTANCE, size, sizeof(QkPoolEntry));
+  if (NULL == p->entries)
+    return false;
+  pthread_mutex_init(&p->lock, NULL);
+  pthread_cond_init(&p->available, NULL);
+
+  for (; p->count < size; p->count += 1) {
+    // the journal mode is persistent, setting it once is enough
+    sqlite3 *db = qk_open_shared(path, p->count == 0);
+    if (NULL == db) {
+      qk_pool_close(p);
+      return false;
+    }
+    qk_conn_init(&p->entries[p->count].conn, db, stmt_cache_capacity);
+  }
+
+  return true;
+}
+
+void qk_pool_close(QkPool *p) {
+  if (NULL == p || NULL == p->entries)
+    return;
+
+  for (size_t i = 0; i < p->count; i += 1) {
+    QkConn *c = &p->entries[i].conn;
+    sqlite3 *db = c->db;
+    qk_conn_free(c);
+    sqlite3_close(db);
+  }
+  CG_FREE(CG_ALLOCATOR_INSTANCE, p->entries);
+  pthread_cond_destroy(&p->available);
+  pthread_mutex_destroy(&p->lock);
+
+  memset(p, 0, sizeof(*p));
+}
+
+QkConn *qk_pool_acquire(QkPool *p) {
+  pthread_t self = pthread_self();
+  uint64_t wait_start = 0;
+
+  pthread_mutex_lock(&p->lock);
+  QkPoolEntry *pick = NULL;
+  while (true) {
+    // own connection first, then one nobody used yet, then any free one
+    for (size_t i = 0; i < p->count; i += 1) {
+      QkPoolEntry *e = &p->entries[i];
+      if (e->busy)
+        continue;
+      if (e->has_owner && pthread_equal(e->owner, self)) {
+        pick = e;
+        p->stats.affinity_hits += 1;
+        break;
+      }
+      if (NULL == pick || (pick->has_owner && !e->has_owner))
+        pick = e;
+    }
+    if (NULL != pick)
+      break;
+
+    if (0 == wait_start) {
+      wait_start = qk_now_ns();
+      p->stats.waits += 1;
+    }
+    pthread_cond_wait(&p->available, &p->lock);
+  }
+
+  pick->busy = true;
+  pick->owner = self;
+  pick->has_owner = true;
+
+  p->stats.acquires += 1;
+  p->stats.in_use += 1;
+  if (p->stats.in_use > p->stats.max_in_use)
+    p->stats.max_in_use = p->stats.in_use;
+  if (0 != wait_start)
+    p->stats.wait_ns += qk_now_ns() - wait_start;
+  pthread_mutex_unlock(&p->lock);
+
+  return &pick->conn;
+}
+
+void qk_pool_release(QkPool *p, QkConn *c) {
+  if (NULL == c)
+    return;
+
+  if (c->tx_depth > 0) {
+    fprintf(stderr, "[Warning] Pool connection released inside a "
+                    "transaction, rolling back\n");
+    while (c->tx_depth > 0 && qk_conn_rollback(c))
+      ;
+  }
+
+  QkPoolEntry *e = (QkPoolEntry *)((char *)c - offsetof(QkPoolEntry, conn));
+  assert(e >= p->entries && e < p->entries + p->count);
+
+  pthread_mutex_lock(&p->lock);
+  e->busy = false;
+  p->stats.releases += 1;
+  p->stats.in_use -= 1;
+  pthread_cond_signal(&p->available);
+  pthread_mutex_unlock(&p->lock);
+}
+
+QkPoolStats qk_pool_stats(QkPool *p) {
+  pthread_mutex_lock(&p->lock);
+  QkPoolStats stats = p->stats;
+  pthread_mutex_unlock(&p->lock);
+  return stats;
+}
+
+bool qk_pool_exec(QkPool *p, QkSqlQuery *q, QkResultSet *out) {
+  QkConn *c = qk_pool_acquire(p);
+  bool ok = qk_conn_exec(c, q, out);
+  qk_pool_release(p, c);
+  return ok;
+}
+
+// Runs one batch in a transaction, each request in its own savepoint
+static void qk_write_queue_run_batch(QkWriteQueue *wq, QkWriteRequest *batch) {
+  QkConn *c = &wq->conn;
+  bool tx = qk_conn_begin(c, QK_TX_IMMEDIATE);
+
+  for (QkWriteRequest *r = batch; NULL != r; r = r->next) {
+    r->ok = tx && qk_conn_begin(c, QK_TX_DEFERRED);
+    if (!r->ok)
+      continue;
+
+    r->ok = qk_conn_exec_built(c, r->q, NULL);
+    if (r->ok) {
+      r->rows_changed = (size_t)sqlite3_changes(c->db);
+      r->ok = qk_conn_commit(c);
+    }
+    if (!r->ok)
+      qk_conn_rollback(c);
+  }
+
+  if (tx && !qk_conn_commit(c)) {
+    qk_conn_rollback(c);
+    for (QkWriteRequest *r = batch; NULL != r; r = r->next)
+      r->ok = false;
+  }
+}
+
+static void *qk_write_queue_main(void *arg) {
+  QkWriteQueue *wq = arg;
+  CG_ALLOCATOR_PUSH(std_allocator);
+
+  pthread_mutex_lock(&wq->lock);
+  while (true) {
+    while (0 == wq->queued && !wq->stopping)
+      pthread_cond_wait(&wq->pending, &wq->lock);
+    if (0 == wq->queued)
+      break; // stopping and drained
+
+    // give other writers a chance to join the batch
+    if (wq->queued < wq->max_batch && !wq->stopping) {
+      struct timespec deadline;
+      timespec_get(&deadline, TIME_UTC);
+      uint64_t ns = (uint64_t)deadline.tv_nsec + wq->max_delay_ns;
+      deadline.tv_sec += (time_t)(ns / 1000000000ULL);
+      deadline.tv_nsec = (long)(ns % 1000000000ULL);
+      while (wq->queued < wq->max_batch && !wq->stopping) {
+        if (pthread_cond_timedwait(&wq->pending, &wq->lock, &deadline) != 0)
+          break;
+      }
+    }
+
+    QkWriteRequest *batch = wq->head;
+    QkWriteRequest *last = batch;
+    size_t n = 1;
+    while (n < wq->max_batch && NULL != last->next) {
+      last = last->next;
+      n += 1;
+    }
+    wq->head = last->next;
+    if (NULL == wq->head)
+      wq->tail = NULL;
+    last->next = NULL;
+    wq->queued -= n;
+    pthread_mutex_unlock(&wq->lock);
+
+    qk_write_queue_run_batch(wq, batch);
+
+    pthread_mutex_lock(&wq->lock);
+    wq->stats.batches += 1;
+    wq->stats.requests += n;
+    if (n > wq->stats.largest_batch)
+      wq->stats.largest_batch = n;
+    for (QkWriteRequest *r = batch; NULL != r; r = r->next) {
+      wq->stats.failed += !r->ok;
+      r->done = true;
+    }
+    pthread_cond_broadcast(&wq->completed);
+  }
+  pthread_mutex_unlock(&wq->lock);
+
+  CG_ALLOCATOR_POP();
+  return NULL;
+}
+
+bool qk_write_queue_start(QkWriteQueue *wq, const char *path, size_t max_batch,
+                          uint64_t max_delay_us) {
+  *wq = (QkWriteQueue){
+      .max_batch = max_batch > 0 ? max_batch : QK_WRITE_BATCH_MAX,
+      .max_delay_ns =
+          (max_delay_us > 0 ? max_delay_us : QK_WRITE_BATCH_DELAY_US) * 1000,
+  };
+
+  sqlite3 *db = qk_open_shared(path, true);
+  if (NULL == db)
+    return false;
+  qk_conn_init(&wq->conn, db, QK_STMT_CACHE_CAPACITY);
+
+  pthread_mutex_init(&wq->lock, NULL);
+  pthread_cond_init(&wq->pending, NULL);
+  pthread_cond_init(&wq->completed, NULL);
+
+  if (pthread_create(&wq->thread, NULL, qk_write_queue_main, wq) != 0) {
+    fprintf(stderr, "[Error] Could not start the writer thread\n");
+    pthread_cond_destroy(&wq->completed);
+    pthread_cond_destroy(&wq->pending);
+    pthread_mutex_destroy(&wq->lock);
+    qk_conn_free(&wq->conn);
+    sqlite3_close(db);
+    return false;
+  }
+  return true;
+}
+
+void qk_write_queue_stop(QkWriteQueue *wq) {
+  if (NULL == wq || NULL == wq->conn.db)
+    return;
+
+  pthread_mutex_lock(&wq->lock);
+  wq->stopping = true;
+  pthread_cond_signal(&wq->pending);
+  pthread_mutex_unlock(&wq->lock);
+  pthread_join(wq->thread, NULL);
+
+  sqlite3 *db = wq->conn.db;
+  qk_conn_free(&wq->conn);
+  sqlite3_close(db);
+  pthread_cond_destroy(&wq->completed);
+  pthread_cond_destroy(&wq->pending);
+  pthread_mutex_destroy(&wq->lock);
+
+  memset(wq, 0, sizeof(*wq));
+}
+
+bool qk_write_queue_submit(QkWriteQueue *wq, QkWriteRequest *r) {
+  if (r->q->op == QK_SELECT) {
+    fprintf(stderr, "[Error] Only writes can be submitted to a write queue\n");
+    return false;
+  }
+  if (!qk_sql_build(r->q, QK_SQL_DIALECT_SQLITE))
+    return false;
+
+  r->done = false;
+  r->ok = false;
+  r->rows_changed = 0;
+  r->next = NULL;
+
+  pthread_mutex_lock(&wq->lock);
+  if (wq->stopping) {
+    pthread_mutex_unlock(&wq->lock);
+    fprintf(stderr, "[Error] Write queue is stopping\n");
+    return false;
+  }
+  if (NULL == wq->tail)
+    wq->head = r;
+  else
+    wq->tail->next = r;
+  wq->tail = r;
+  wq->queued += 1;
+  if (1 == wq->queued || wq->queued >= wq->max_batch)
+    pthread_cond_signal(&wq->pending);
+  pthread_mutex_unlock(&wq->lock);
+
+  return true;
+}
+
+bool qk_write_queue_wait(QkWriteQueue *wq, QkWriteRequest *r) {
+  pthread_mutex_lock(&wq->lock);
+  while (!r->done)
+    pthread_cond_wait(&wq->completed, &wq->lock);
+  pthread_mutex_unlock(&wq->lock);
+  return r->ok;
+}
+
+bool qk_write_queue_exec(QkWriteQueue *wq, QkSqlQuery *q) {
+  QkWriteRequest r = {.q = q};
+  return qk_write_queue_submit(wq, &r) && qk_write_queue_wait(wq, &r);
+}
+
+QkWriteQueueStats qk_write_queue_stats(QkWriteQueue *wq) {
+  pthread_mutex_lock(&wq->lock);
+  QkWriteQueueStats stats = wq->stats;
+  pthread_mutex_unlock(&wq->lock);
+  return stats;
+}
+
+static void *qk_async_main(void *arg) {
+  QkAsync *a = arg;
+  CG_ALLOCATOR_PUSH(std_allocator);
+
+  pthread_mutex_lock(&a->lock);
+  while (true) {
+    while (NULL == a->head && !a->stopping)
+      pthread_cond_wait(&a->pending, &a->lock);
+    if (NULL == a->head)
+      break; // stopping and drained
+
+    QkFuture *f = a->head;
+    a->head = f->next;
+    if (NULL == a->head)
+      a->tail = NULL;
+    pthread_mutex_unlock(&a->lock);
+
+    QkConn *c = qk_pool_acquire(a->pool);
+    f->ok = qk_conn_exec_built(c, f->q, &f->result);
+    qk_pool_release(a->pool, c);
+
+    if (NULL != f->on_done) {
+      // f belongs to the callback from now on
+      f->on_done(f, f->user_data);
+      pthread_mutex_lock(&a->lock);
+    } else {
+      pthread_mutex_lock(&a->lock);
+      f->done = true;
+      pthread_cond_broadcast(&a->completed);
+    }
+  }
+  pthread_mutex_unlock(&a->lock);
+
+  CG_ALLOCATOR_POP();
+  return NULL;
+}
+
+bool qk_async_start(QkAsync *a, QkPool *pool, size_t threads) {
+  *a = (QkAsync){.pool = pool};
+  if (0 == threads)
+    threads = pool->count;
+
+  a->threads = CG_MALLOC(CG_ALLOCATOR_INSTANCE, threads * sizeof(pthread_t));
+  if (NULL == a->threads)
+    return false;
+  pthread_mutex_init(&a->lock, NULL);
+  pthread_cond_init(&a->pending, NULL);
+  pthread_cond_init(&a->completed, NULL);
+
+  for (; a->thread_count < threads; a->thread_count += 1) {
+    if (pthread_create(&a->threads[a->thread_count], NULL, qk_async_main, a) !=
+        0) {
+      fprintf(stderr, "[Error] Could not start an async worker\n");
+      qk_async_stop(a);
+      return false;
+    }
+  }
+  return true;
+}
+
+void qk_async_stop(QkAsync *a) {
+  if (NULL == a || NULL == a->threads)
+    return;
+
+  pthread_mutex_lock(&a->lock);
+  a->stopping = true;
+  pthread_cond_broadcast(&a->pending);
+  pthread_mutex_unlock(&a->lock);
+  for (size_t i = 0; i < a->thread_count; i += 1) {
+    pthread_join(a->threads[i], NULL);
+  }
+
+  CG_FREE(CG_ALLOCATOR_INSTANCE, a->threads);
+  pthread_cond_destroy(&a->completed);
+  pthread_cond_destroy(&a->pending);
+  pthread_mutex_destroy(&a->lock);
+
+  memset(a, 0, sizeof(*a));
+}
+
+bool qk_async_submit(QkAsync *a, QkFuture *f, QkSqlQuery *q,
+                     QkFutureFn on_done, void *user_data) {
+  if (!qk_sql_build(q, QK_SQL_DIALECT_SQLITE))
+    return false;
+
+  *f = (QkFuture){
+      .q = q,
+      .on_done = on_done,
+      .user_data = user_data,
+  };
+
+  pthread_mutex_lock(&a->lock);
+  if (a->stopping) {
+    pthread_mutex_unlock(&a->lock);
+    fprintf(stderr, "[Error] Async executor is stopping\n");
+    return false;
+  }
+  if (NULL == a->tail)
+    a->head = f;
+  else
+    a->tail->next = f;
+  a->tail = f;
+  pthread_cond_signal(&a->pending);
+  pthread_mutex_unlock(&a->lock);
+
+  return true;
+}
+
+bool qk_future_wait(QkAsync *a, QkFuture *f) {
+  assert(NULL == f->on_done && "Futures with a callback can not be waited");
+  pthread_mutex_lock(&a->lock);
+  while (!f->done)
+    pthread_cond_wait(&a->completed, &a->lock);
+  pthread_mutex_unlock(&a->lock);
+  return f->ok;
+}
+
+bool qk_future_ready(QkAsync *a, QkFuture *f) {
+  pthread_mutex_lock(&a->lock);
+  bool done = f->done;
+  pthread_mutex_unlock(&a->lock);
+  return done;
+}
+
+// Binds p in place and takes over its text (Str passed in are moved), the
+// previous text of the slot is released once SQLite no longer points to it
+static bool qk_compiled_bind_slot_param(QkCompiledQuery *cq, QkBindSlot *slot,
+                                        QkParam *p) {
+  bool ok = qk_bind_param_sqlite_mode(cq->stmt, slot->idx, p, QK_BIND_STATIC);
+  Str old = slot->value;
+  slot->value = qk_param_has_str(*p) ? p->as.s : (Str){0};
+  str_free(&old);
+  return ok;
+}
+
+bool qk_sql_compile_sqlite(QkSqlQuery *q, sqlite3 *db, QkCompiledQuery *out) {
+  if (!qk_sql_build(q, QK_SQL_DIALECT_SQLITE))
+    return false;
+
+  QkCompiledQuery cq = {.op = q->op, .db = db};
+  if (sqlite3_prepare_v3(db, sb_get_cstr(&q->b), -1, SQLITE_PREPARE_PERSISTENT,
+                         &cq.stmt, NULL) != SQLITE_OK) {
+    fprintf(stderr, "SQL prepare error: %s\n", sqlite3_errmsg(db));
+    return false;
+  }
+
+  int idx = 1;
+  if (q->op == QK_INSERT || q->op == QK_UPDATE) {
+    size_t rows = q->param_rows.count;
+    size_t cols = q->param_rows.items[0].count;
+    da_alloc_reserved(cq.params, rows * cols);
+    for (size_t i = 0; i < rows * cols; i += 1) {
+      QkBindSlot slot = {
+          .column = str_clone(&q->columns.items[i % cols]),
+          .idx = idx++,
+      };
+      da_push(cq.params, slot);
+    }
+  }
+
+  // the seek values of a paged query follow the conditions
+  size_t seek = q->page.after.count;
+  if (q->op != QK_INSERT && q->where.count + seek > 0) {
+    da_alloc_reserved(cq.where, q->where.count + seek);
+    for (size_t i = 0; i < q->where.count; i += 1) {
+      QkBindSlot slot = {
+          .column = str_clone(&q->where.items[i].cv.column),
+          .idx = idx++,
+      };
+      da_push(cq.where, slot);
+    }
+    for (size_t i = 0; i < seek; i += 1) {
+      QkBindSlot slot = {
+          .column = str_clone(&q->page.keys.items[i]),
+          .idx = idx++,
+      };
+      da_push(cq.where, slot);
+    }
+  }
+
+  // the slots keep their own references to text, so q can go away
+  for (size_t i = 0; i < cq.params.count; i += 1) {
+    size_t cols = q->param_rows.items[0].count;
+    QkParam p = q->param_rows.items[i / cols].items[i % cols];
+    if (qk_param_has_str(p))
+      p.as.s = str_clone(&p.as.s);
+    qk_compiled_bind_slot_param(&cq, &cq.params.items[i], &p);
+  }
+  for (size_t i = 0; i < cq.where.count; i += 1) {
+    QkParam p = i < q->where.count ? q->where.items[i].cv.param
+                                   : q->page.after.items[i - q->where.count];
+    if (qk_param_has_str(p))
+      p.as.s = str_clone(&p.as.s);
+    qk_compiled_bind_slot_param(&cq, &cq.where.items[i], &p);
+  }
+
+  *out = cq;
+  return true;
+}
+
+static bool qk_compiled_bind_slot(QkCompiledQuery *cq, QkBindSlotArr *slots,
+                                  size_t i, QkParam *p) {
+  if (i >= slots->count) {
+    fprintf(stderr, "[Error] Bind position %zu out of range (%zu)\n", i,
+            slots->count);
+    return false;
+  }
+  return qk_compiled_bind_slot_param(cq, &slots->items[i], p);
+}
+
+static bool qk_compiled_bind_slot_by_name(QkCompiledQuery *cq,
+                                          QkBindSlotArr *slots,
+                                          StringView column, QkParam *p) {
+  for (size_t i = 0; i < slots->count; i += 1) {
+    if (sv_equals_icase(&sv_from_str(slots->items[i].column), &column))
+      return qk_compiled_bind_slot_param(cq, &slots->items[i], p);
+  }
+  fprintf(stderr, "[Error] No parameter for column '" sv_farg "'\n",
+          sv_expand(column));
+  return false;
+}
+
+bool qk_compiled_bind_param(QkCompiledQuery *cq, size_t i, QkParam p) {
+  return qk_compiled_bind_slot(cq, &cq->params, i, &p);
+}
+
+bool qk_compiled_bind_param_by_name(QkCompiledQuery *cq, StringView column,
+                                    QkParam p) {
+  return qk_compiled_bind_slot_by_name(cq, &cq->params, column, &p);
+}
+
+bool qk_compiled_bind_where(QkCompiledQuery *cq, size_t i, QkParam p) {
+  return qk_compiled_bind_slot(cq, &cq->where, i, &p);
+}
+
+bool qk_compiled_bind_where_by_name(QkCompiledQuery *cq, StringView column,
+                                    QkParam p) {
+  return qk_compiled_bind_slot_by_name(cq, &cq->where, column, &p);
+}
+
+bool qk_compiled_exec(QkCompiledQuery *cq, QkResultSet *out) {
+  QkTrace t;
+  qk_trace_begin(&t, cq->op);
+
+  bool ok = qk_sql_step_sqlite(cq->db, cq->stmt, out, &t.ev);
+  qk_trace_lap(&t, &t.ev.step_ns);
+  qk_trace_end(&t, cq->db, sqlite3_sql(cq->stmt), ok);
+
+  sqlite3_reset(cq->stmt);
+  return ok;
+}
+
+void qk_compiled_free(QkCompiledQuery *cq) {
+  if (NULL == cq)
+    return;
+
+  sqlite3_finalize(cq->stmt);
+
+  for (size_t i = 0; i < cq->params.count; i += 1) {
+    str_free(&cq->params.items[i].column);
+    str_free(&cq->params.items[i].value);
+  }
+  da_free(cq->params);
+
+  for (size_t i = 0; i < cq->where.count; i += 1) {
+    str_free(&cq->where.items[i].column);
+    str_free(&cq->where.items[i].value);
+  }
+  da_free(cq->where);
+
+  memset(cq, 0, sizeof(*cq));
+}
+
+// Prepares the insert statement for chunks of rows rows
+static sqlite3_stmt *qk_bulk_prepare(QkConn *c, QkSqlQuery *q, size_t rows,
+                                     size_t cols, QkTrace *t) {
+  q->b.count = 0;
+  qk_sql_add_insert_head(q, QK_SQL_DIALECT_SQLITE);
+  qk_sql_add_values(q, rows, cols);
+  sb_append_rune(&q->b, '\0');
+  sqlite3_stmt *stmt = qk_conn_prepare(c, q->b.items);
+  qk_trace_lap(t, &t->ev.prepare_ns);
+  return stmt;
+}
+
+static bool qk_bulk_exec_chunk(QkConn *c, sqlite3_stmt *stmt, QkSqlQuery *q,
+                               size_t from, size_t rows, size_t cols,
+                               QkTrace *t) {
+  for (size_t i = 0; i < rows; i += 1) {
+    QkParamArr *row = &q->param_rows.items[from + i];
+    for (size_t j = 0; j < cols; j += 1) {
+      if (!qk_bind_param_sqlite_mode(stmt, (int)(i * cols + j + 1),
+                                     &row->items[j], QK_BIND_STATIC))
+        return false;
+    }
+  }
+  qk_trace_lap(t, &t->ev.bind_ns);
+
+  int rc = sqlite3_step(stmt);
+  sqlite3_reset(stmt);
+  qk_trace_lap(t, &t->ev.step_ns);
+  if (rc != SQLITE_DONE) {
+    printf("[Error] sqlite3 step failed: %s\n", sqlite3_errmsg(c->db));
+    return false;
+  }
+  return true;
+}
+
+bool qk_conn_bulk_insert(QkConn *c, QkSqlQuery *q, size_t chunk_rows,
+                         QkBulkStats *stats) {
+  if (q->op != QK_INSERT || q->columns.count == 0)
+    return false;
+
+  size_t cols = q->columns.count;
+  size_t total = q->param_rows.count;
+  for (size_t i = 0; i < total; i += 1) {
+    if (q->param_rows.items[i].count != cols)
+      return false;
+  }
+
+  size_t max_vars =
+      (size_t)sqlite3_limit(c->db, SQLITE_LIMIT_VARIABLE_NUMBER, -1);
+  size_t chunk = chunk_rows > 0 ? chunk_rows : QK_BULK_CHUNK_ROWS;
+  if (chunk * cols > max_vars)
+    chunk = max_vars / cols;
+  if (chunk == 0)
+    return false;
+
+  uint64_t start = qk_now_ns();
+
+  if (!qk_conn_begin(c, QK_TX_IMMEDIATE))
+    return false;
+
+  QkTrace t;
+  qk_trace_begin(&t, QK_INSERT);
+
+  bool ok = true;
+  size_t done = 0;
+  size_t chunks = 0;
+
+  if (total >= chunk) {
+    sqlite3_stmt *stmt = qk_bulk_prepare(c, q, chunk, cols, &t);
+    ok = NULL != stmt;
+    while (ok && total - done >= chunk) {
+      ok = qk_bulk_exec_chunk(c, stmt, q, done, chunk, cols, &t);
+      done += chunk;
+      chunks += 1;
+    }
+    qk_conn_release(c, stmt);
+  }
+
+  if (ok && done < total) {
+    size_t rest = total - done;
+    sqlite3_stmt *stmt = qk_bulk_prepare(c, q, rest, cols, &t);
+    ok = NULL != stmt && qk_bulk_exec_chunk(c, stmt, q, done, rest, cols, &t);
+    done += rest;
+    chunks += 1;
+    qk_conn_release(c, stmt);
+  }
+
+  if (t.on) {
+    t.ev.rows_changed = ok ? total : 0;
+    qk_trace_report(&t.hook, &t.ev, q->b.items, ok);
+  }
+
+  if (ok)
+    ok = qk_conn_commit(c);
+  if (!ok)
+    qk_conn_rollback(c);
+
+  if (NULL != stats) {
+    double seconds = (double)(qk_now_ns() - start) / 1e9;
+    *stats = (QkBulkStats){
+        .rows = ok ? total : 0,
+        .chunks = chunks,
+        .seconds = seconds,
+        .rows_per_sec = ok && seconds > 0 ? (double)total / seconds : 0,
+    };
+  }
+
+  return ok;
+}
+
+// Grows da geometrically so that it can hold at least n items
+#define qk_da_reserve(da, n)                                                   \
+  do {                                                                         \
+    if ((da).capacity < (n)) {                                                 \
+      size_t _cap = (da).capacity ? (da).capacity : DA_INIT_CAPACITY;          \
+      while (_cap < (n))                                                       \
+        _cap *= DA_GROW_FACTOR;                                                \
+      da_resize((da), _cap);                                                   \
+    }                                                                          \
+  } while (0)
+
+static void qk_column_set_kind(QkColumn *col, QkParamKind kind,
+                               size_t row_count) {
+  col->kind = kind;
+
+  // rows seen so far were all NULL, give them zero values
+  switch (kind) {
+  case QK_INT:
+    qk_da_reserve(col->ints, row_count);
+    col->ints.count = row_count;
+    break;
+  case QK_DOUBLE:
+    qk_da_reserve(col->doubles, row_count);
+    col->doubles.count = row_count;
+    break;
+  case QK_STR:
+  case QK_BLOB:
+    qk_da_reserve(col->offsets, row_count + 1);
+    col->offsets.count = row_count + 1;
+    break;
+  default:
+    break;
+  }
+}
+
+static void qk_column_push(QkColumn *col, sqlite3_stmt *stmt, int i,
+                           size_t row) {
+  int type = sqlite3_column_type(stmt, i);
+
+  if (row % 8 == 0)
+    da_push(col->nulls, 0);
+  if (type == SQLITE_NULL)
+    col->nulls.items[row >> 3] |= (uint8_t)(1u << (row & 7));
+
+  if (col->kind == QK_PARAM_NULL) {
+    switch (type) {
+    case SQLITE_NULL:
+      return;
+    case SQLITE_INTEGER:
+      qk_column_set_kind(col, QK_INT, row);
+      break;
+    case SQLITE_FLOAT:
+      qk_column_set_kind(col, QK_DOUBLE, row);
+      break;
+    case SQLITE_TEXT:
+      qk_column_set_kind(col, QK_STR, row);
+      break;
+    case SQLITE_BLOB:
+      qk_column_set_kind(col, QK_BLOB, row);
+      break;
+    default:
+      fprintf(stderr, "Unsupported SQLite column type\n");
+      return;
+    }
+  }
+
+  switch (col->kind) {
+  case QK_INT:
+    da_push(col->ints, sqlite3_column_int64(stmt, i));
+    break;
+  case QK_DOUBLE:
+    da_push(col->doubles, sqlite3_column_double(stmt, i));
+    break;
+  case QK_STR:
+  case QK_BLOB: {
+    const void *text = col->kind == QK_STR
+                           ? (const void *)sqlite3_column_text(stmt, i)
+                           : sqlite3_column_blob(stmt, i);
+    size_t len = (size_t)sqlite3_column_bytes(stmt, i);
+    qk_da_reserve(col->bytes, col->bytes.count + len);
+    if (len > 0)
+      memcpy(col->bytes.items + col->bytes.count, text, len);
+    col->bytes.count += len;
+    da_push(col->offsets, col->bytes.count);
+  } break;
+  default:
+    break;
+  }
+}
+
+static bool qk_sql_step_columnar_sqlite(sqlite3 *db, sqlite3_stmt *stmt,
+                                        QkColumnarResult *out,
+                                        QkTraceEvent *ev) {
+  int col_count = sqlite3_column_count(stmt);
+  if (out->columns.capacity == 0 && col_count > 0)
+    da_alloc_reserved(out->columns, col_count);
+  for (int i = 0; i < col_count; i += 1) {
+    QkColumn col = {
+        .name = str_from_cstr(sqlite3_column_name(stmt, i)),
+        .kind = QK_PARAM_NULL,
+    };
+    da_push(out->columns, col);
+  }
+
+  while (true) {
+    int rc = sqlite3_step(stmt);
+    if (rc == SQLITE_DONE)
+      break;
+    else if (rc != SQLITE_ROW) {
+      printf("[Error] sqlite3 step failed: %s\n", sqlite3_errmsg(db));
+      return false;
+    }
+
+    for (int i = 0; i < col_count; i += 1) {
+      qk_column_push(&out->columns.items[i], stmt, i, out->row_count);
+    }
+    out->row_count += 1;
+  }
+
+  ev->rows_returned = out->row_count;
+  for (int i = 0; i < col_count; i += 1) {
+    QkColumn *col = &out->columns.items[i];
+    ev->bytes_materialized += col->ints.count * sizeof(int64_t) +
+                              col->doubles.count * sizeof(double) +
+                              col->offsets.count * sizeof(size_t) +
+                              col->bytes.count + col->nulls.count;
+  }
+
+  return true;
+}
+
+bool qk_sql_exec_columnar_sqlite(QkSqlQuery *q, sqlite3 *db,
+                                 QkColumnarResult *out) {
+  if (!qk_sql_build(q, QK_SQL_DIALECT_SQLITE))
+    return false;
+
+  const char *sql = sb_get_cstr(&q->b);
+
+  QkTrace t;
+  qk_trace_begin(&t, q->op);
+
+  sqlite3_stmt *stmt = NULL;
+  if (sqlite3_prepare_v2(db, sql, -1, &stmt, NULL) != SQLITE_OK) {
+    fprintf(stderr, "SQL prepare error: %s\n", sqlite3_errmsg(db));
+    qk_trace_end(&t, db, sql, false);
+    return false;
+  }
+  qk_trace_lap(&t, &t.ev.prepare_ns);
+
+  qk_sql_bind_sqlite(q, stmt);
+  qk_trace_lap(&t, &t.ev.bind_ns);
+
+  bool ok = qk_sql_step_columnar_sqlite(db, stmt, out, &t.ev);
+  qk_trace_lap(&t, &t.ev.step_ns);
+  qk_trace_end(&t, db, sql, ok);
+
+  sqlite3_finalize(stmt);
+  return ok;
+}
+
+bool qk_conn_exec_columnar(QkConn *c, QkSqlQuery *q, QkColumnarResult *out) {
+  if (!qk_sql_build(q, QK_SQL_DIALECT_SQLITE))
+    return false;
+
+  const char *sql = sb_get_cstr(&q->b);
+
+  QkTrace t;
+  qk_trace_begin(&t, q->op);
+
+  sqlite3_stmt *stmt = qk_conn_prepare_traced(c, sql, &t);
+  if (NULL == stmt)
+    return false;
+
+  qk_sql_bind_sqlite(q, stmt);
+  qk_trace_lap(&t, &t.ev.bind_ns);
+
+  bool ok = qk_sql_step_columnar_sqlite(c->db, stmt, out, &t.ev);
+  qk_trace_lap(&t, &t.ev.step_ns);
+  qk_trace_end(&t, c->db, sql, ok);
+
+  qk_conn_release(c, stmt);
+  return ok;
+}
+
+QkColumn *qk_columnar_find(QkColumnarResult *res, StringView name) {
+  for (size_t i = 0; i < res->columns.count; i += 1) {
+    if (sv_equals_icase(&sv_from_str(res->columns.items[i].name), &name))
+      return &res->columns.items[i];
+  }
+  return NULL;
+}
+
+void qk_columnar_result_free(QkColumnarResult *res) {
+  if (NULL == res)
+    return;
+
+  for (size_t i = 0; i < res->columns.count; i += 1) {
+    QkColumn *col = &res->columns.items[i];
+    str_free(&col->name);
+    da_free(col->ints);
+    da_free(col->doubles);
+    da_free(col->offsets);
+    sb_free(col->bytes);
+    da_free(col->nulls);
+  }
+  da_free(res->columns);
+
+  memset(res, 0, sizeof(*res));
+}
+
+bool qk_cursor_open(QkCursor *cur, QkSqlQuery *q, sqlite3 *db) {
+  if (!qk_sql_build(q, QK_SQL_DIALECT_SQLITE))
+    return false;
+
+  const char *sql = sb_get_cstr(&q->b);
+
+  QkTrace t;
+  qk_trace_begin(&t, q->op);
+
+  sqlite3_stmt *stmt = NULL;
+  if (sqlite3_prepare_v2(db, sql, -1, &stmt, NULL) != SQLITE_OK) {
+    fprintf(stderr, "SQL prepare error: %s\n", sqlite3_errmsg(db));
+    qk_trace_end(&t, db, sql, false);
+    return false;
+  }
+
+  qk_trace_lap(&t, &t.ev.prepare_ns);
+
+  qk_sql_bind_sqlite(q, stmt);
+  qk_trace_lap(&t, &t.ev.bind_ns);
+
+  *cur = (QkCursor){.db = db, .stmt = stmt, .owns_stmt = true};
+  cur->trace = t.ev;
+  cur->trace_hook = t.hook;
+  cur->tracing = t.on;
+  return true;
+}
+
+bool qk_conn_cursor_open(QkCursor *cur, QkConn *c, QkSqlQuery *q) {
+  if (!qk_sql_build(q, QK_SQL_DIALECT_SQLITE))
+    return false;
+
+  QkTrace t;
+  qk_trace_begin(&t, q->op);
+
+  sqlite3_stmt *stmt = qk_conn_prepare_traced(c, sb_get_cstr(&q->b), &t);
+  if (NULL == stmt)
+    return false;
+
+  qk_sql_bind_sqlite(q, stmt);
+  qk_trace_lap(&t, &t.ev.bind_ns);
+
+  *cur = (QkCursor){.db = c->db, .stmt = stmt, .conn = c};
+  cur->trace = t.ev;
+  cur->trace_hook = t.hook;
+  cur->tracing = t.on;
+  return true;
+}
+
+bool qk_compiled_cursor_open(QkCursor *cur, QkCompiledQuery *cq) {
+  sqlite3_reset(cq->stmt);
+  *cur = (QkCursor){.db = cq->db, .stmt = cq->stmt};
+  cur->trace = (QkTraceEvent){.op = cq->op};
+  cur->trace_hook = qk_trace_hook_load();
+  cur->tracing = NULL != cur->trace_hook.fn;
+  return true;
+}
+
+bool qk_cursor_next(QkCursor *cur) {
+  if (cur->row_ready) {
+    qk_result_row_clear(&cur->row);
+    cur->row_ready = false;
+  }
+
+  if (cur->failed || NULL == cur->stmt)
+    return false;
+
+  uint64_t start = cur->tracing ? qk_now_ns() : 0;
+  int rc = sqlite3_step(cur->stmt);
+  if (cur->tracing)
+    cur->trace.step_ns += qk_now_ns() - start;
+
+  if (rc == SQLITE_ROW) {
+    cur->trace.rows_returned += 1;
+    return true;
+  }
+
+  if (rc != SQLITE_DONE) {
+    printf("[Error] sqlite3 step failed: %s\n", sqlite3_errmsg(cur->db));
+    cur->failed = true;
+  }
+  return false;
+}
+
+int qk_cursor_column_count(QkCursor *cur) {
+  return sqlite3_column_count(cur->stmt);
+}
 
-  sb_append_rune(&q->b, '\0');
-  return true;
+StringView qk_cursor_column_name(QkCursor *cur, int i) {
+  return sv_from_cstr(sqlite3_column_name(cur->stmt, i));
 }
 
-bool qk_bind_param_sqlite(sqlite3_stmt *stmt, int idx, QkParam *p) {
-  switch (p->kind) {
-  case QK_PARAM_NONE:
-    fprintf(stderr, "[Error] QK_PARAM_NONE should not be passed to query\n");
-    return false;
-  case QK_PARAM_NULL:
-    sqlite3_bind_null(stmt, idx);
-    break;
-  case QK_BOOL:
-  case QK_INT:
-    sqlite3_bind_int(stmt, idx, p->as.i);
-    break;
-  case QK_DOUBLE:
-    sqlite3_bind_double(stmt, idx, p->as.d);
-    break;
-  case QK_STR:
-    sqlite3_bind_text(stmt, idx, p->as.s.h->b.items, (int)p->as.s.h->b.count,
-                      SQLITE_TRANSIENT);
-    break;
-  }
+bool qk_cursor_is_null(QkCursor *cur, int i) {
+  return sqlite3_column_type(cur->stmt, i) == SQLITE_NULL;
+}
 
-  return true;
+int qk_cursor_int(QkCursor *cur, int i) {
+  return sqlite3_column_int(cur->stmt, i);
 }
 
-static size_t qk_bind_params(QkSqlQuery *q, sqlite3_stmt *stmt, size_t offset) {
-  size_t rows = q->param_rows.count;
-  size_t cols = q->param_rows.items[0].count;
+int64_t qk_cursor_int64(QkCursor *cur, int i) {
+  return sqlite3_column_int64(cur->stmt, i);
+}
 
-  for (size_t i = 0; i < rows; i += 1) {
-    for (size_t j = 0; j < cols; j += 1) {
-      size_t idx = offset + 1 + (i * cols + j);
-      qk_bind_param_sqlite(stmt, idx, &q->param_rows.items[i].items[j]);
-    }
-  }
+double qk_cursor_double(QkCursor *cur, int i) {
+  return sqlite3_column_double(cur->stmt, i);
+}
 
-  return rows * cols;
+StringView qk_cursor_text(QkCursor *cur, int i) {
+  const char *text = (const char *)sqlite3_column_text(cur->stmt, i);
+  if (NULL == text)
+    return sv_empty;
+  return (StringView){
+      .begin = text,
+      .length = (size_t)sqlite3_column_bytes(cur->stmt, i),
+  };
 }
 
-static size_t qk_bind_where(QkSqlQuery *q, sqlite3_stmt *stmt, size_t offset) {
-  for (int i = 0; i < (int)q->where.count; ++i) {
-    qk_bind_param_sqlite(stmt, offset + i + 1, &q->where.items[i].cv.param);
+StringView qk_cursor_blob(QkCursor *cur, int i) {
+  const char *blob = sqlite3_column_blob(cur->stmt, i);
+  if (NULL == blob)
+    return sv_empty;
+  return (StringView){
+      .begin = blob,
+      .length = (size_t)sqlite3_column_bytes(cur->stmt, i),
+  };
+}
+
+QkResultRow *qk_cursor_row(QkCursor *cur) {
+  if (!cur->row_ready) {
+    if (NULL == cur->names.items)
+      cur->trace.bytes_materialized += qk_column_names(cur->stmt, &cur->names);
+    cur->trace.bytes_materialized +=
+        qk_row_from_stmt(cur->stmt, &cur->names, &cur->row);
+    cur->row_ready = true;
   }
-  return q->where.count;
+  return &cur->row;
 }
 
-bool qk_sql_exec_sqlite(QkSqlQuery *q, sqlite3 *db, QkResultSet *out) {
-  if (!qk_sql_build(q, QK_SQL_DIALECT_SQLITE))
-    return false;
+void qk_cursor_close(QkCursor *cur) {
+  if (NULL == cur)
+    return;
 
-  const char *sql = sb_get_cstr(&q->b);
-  printf("Executing SQL: %s\n", sql);
+  qk_result_row_clear(&cur->row);
+  da_free(cur->row.columns);
+  for (size_t i = 0; i < cur->names.count; i += 1) {
+    str_free(&cur->names.items[i]);
+  }
+  da_free(cur->names);
 
-  sqlite3_stmt *stmt = NULL;
-  if (sqlite3_prepare_v2(db, sql, -1, &stmt, NULL) != SQLITE_OK) {
-    fprintf(stderr, "SQL prepare error: %s\n", sqlite3_errmsg(db));
-    return false;
+  if (cur->tracing && NULL != cur->stmt) {
+    if (cur->trace.op != QK_SELECT && !cur->failed)
+      cur->trace.rows_changed = (size_t)sqlite3_changes(cur->db);
+    qk_trace_report(&cur->trace_hook, &cur->trace, sqlite3_sql(cur->stmt),
+                    !cur->failed);
   }
 
-  switch (q->op) {
-  case QK_DELETE:
-  case QK_SELECT:
-    qk_bind_where(q, stmt, 0);
-    break;
+  if (NULL != cur->conn)
+    qk_conn_release(cur->conn, cur->stmt);
+  else if (cur->owns_stmt)
+    sqlite3_finalize(cur->stmt);
+  else if (NULL != cur->stmt)
+    sqlite3_reset(cur->stmt);
 
-  case QK_INSERT:
-    qk_bind_params(q, stmt, 0);
-    break;
+  memset(cur, 0, sizeof(*cur));
+}
 
-  case QK_UPDATE: {
-    size_t offset = qk_bind_params(q, stmt, 0);
-    qk_bind_where(q, stmt, offset);
-  } break;
+bool qk_blob_stream_open(QkBlobStream *bs, sqlite3 *db, const char *table,
+                         const char *column, int64_t rowid, bool writable) {
+  *bs = (QkBlobStream){.db = db};
+  if (sqlite3_blob_open(db, "main", table, column, rowid, writable,
+                        &bs->blob) != SQLITE_OK) {
+    fprintf(stderr, "[Error] Could not open blob: %s\n", sqlite3_errmsg(db));
+    sqlite3_blob_close(bs->blob);
+    bs->blob = NULL;
+    return false;
   }
+  bs->size = (size_t)sqlite3_blob_bytes(bs->blob);
+  return true;
+}
 
-  // Execute and collect rows
-  while (true) {
-    int rc = sqlite3_step(stmt);
-    if (rc == SQLITE_DONE)
-      break;
-    else if (rc != SQLITE_ROW) {
-      printf("[Error] sqlite3 step failed: %s\n", sqlite3_errmsg(db));
-      break;
-    }
-
-    QkResultRow row = {0};
-    int col_count = sqlite3_column_count(stmt);
+bool qk_blob_stream_reopen(QkBlobStream *bs, int64_t rowid) {
+  bs->offset = 0;
+  bs->failed = false;
+  if (sqlite3_blob_reopen(bs->blob, rowid) != SQLITE_OK) {
+    fprintf(stderr, "[Error] Could not reopen blob: %s\n",
+            sqlite3_errmsg(bs->db));
+    bs->size = 0;
+    bs->failed = true;
+    return false;
+  }
+  bs->size = (size_t)sqlite3_blob_bytes(bs->blob);
+  return true;
+}
 
-    for (int i = 0; i < col_count; ++i) {
-      Str col_name = str_from_cstr(sqlite3_column_name(stmt, i));
-      int type = sqlite3_column_type(stmt, i);
+size_t qk_blob_stream_read(QkBlobStream *bs, void *buf, size_t n) {
+  if (bs->failed || bs->offset >= bs->size)
+    return 0;
 
-      QkResultColumn col = {
-          .column_name = col_name,
-      };
+  if (n > bs->size - bs->offset)
+    n = bs->size - bs->offset;
+  if (sqlite3_blob_read(bs->blob, buf, (int)n, (int)bs->offset) != SQLITE_OK) {
+    fprintf(stderr, "[Error] Blob read failed: %s\n", sqlite3_errmsg(bs->db));
+    bs->failed = true;
+    return 0;
+  }
+  bs->offset += n;
+  return n;
+}
 
-      switch (type) {
-      case SQLITE_INTEGER:
-        col.value = qk_int(sqlite3_column_int(stmt, i));
-        break;
-      case SQLITE_FLOAT:
-        col.value = qk_double(sqlite3_column_double(stmt, i));
-        break;
-      case SQLITE_TEXT: {
-        Str text = str_from_cstr((const char *)sqlite3_column_text(stmt, i));
-        col.value = qk_str(text);
-        break;
-      }
-      case SQLITE_NULL:
-        col.value.kind = QK_PARAM_NULL;
-        break;
-      default:
-        fprintf(stderr, "Unsupported SQLite column type\n");
-        break;
-      }
+bool qk_blob_stream_write(QkBlobStream *bs, const void *buf, size_t n) {
+  if (bs->failed)
+    return false;
 
-      if (out != NULL) {
-        da_push(row.columns, col);
-      }
-    }
-    if (out != NULL) {
-      da_push(out->rows, row);
-    }
+  if (n > bs->size - bs->offset) {
+    fprintf(stderr, "[Error] Blob write past the end of the blob\n");
+    return false;
+  }
+  if (sqlite3_blob_write(bs->blob, buf, (int)n, (int)bs->offset) !=
+      SQLITE_OK) {
+    fprintf(stderr, "[Error] Blob write failed: %s\n",
+            sqlite3_errmsg(bs->db));
+    bs->failed = true;
+    return false;
   }
+  bs->offset += n;
+  return true;
+}
 
-  sqlite3_finalize(stmt);
+bool qk_blob_stream_seek(QkBlobStream *bs, size_t offset) {
+  if (offset > bs->size)
+    return false;
+  bs->offset = offset;
   return true;
 }
 
+void qk_blob_stream_close(QkBlobStream *bs) {
+  if (NULL == bs)
+    return;
+  sqlite3_blob_close(bs->blob);
+  memset(bs, 0, sizeof(*bs));
+}
+
 void qk_sql_query_free(QkSqlQuery *q) {
   if (NULL == q)
     return;
@@ -587,7 +3414,7 @@ void qk_sql_query_free(QkSqlQuery *q) {
   for (size_t i = 0; i < q->where.count; i += 1) {
     QkSqlCond *cond = &q->where.items[i];
     str_free(&cond->cv.column);
-    if (cond->cv.param.kind == QK_STR) {
+    if (qk_param_has_str(cond->cv.param)) {
       str_free(&cond->cv.param.as.s);
     }
   }
@@ -597,7 +3424,7 @@ void qk_sql_query_free(QkSqlQuery *q) {
   for (size_t i = 0; i < q->param_rows.count; i += 1) {
     for (size_t j = 0; j < q->param_rows.items[i].count; j += 1) {
       QkParam *p = &q->param_rows.items[i].items[j];
-      if (p->kind == QK_STR) {
+      if (qk_param_has_str(*p)) {
         str_free(&p->as.s);
       }
     }
@@ -608,6 +3435,14 @@ void qk_sql_query_free(QkSqlQuery *q) {
   // order by
   str_free(&q->order_by.column);
 
+  // page
+  for (size_t i = 0; i < q->page.keys.count; i += 1) {
+    str_free(&q->page.keys.items[i]);
+  }
+  da_free(q->page.keys);
+  qk_page_after_free(q);
+  da_free(q->page.after);
+
   // builder
   sb_free(q->b);
 
@@ -618,23 +3453,214 @@ void qk_result_set_free(QkResultSet *res) {
   if (NULL == res)
     return;
 
-  for (size_t i = 0; i < res->rows.count; i += 1) {
-    for (size_t j = 0; j < res->rows.items[i].columns.count; j += 1) {
-      QkResultColumn *col = &res->rows.items[i].columns.items[j];
-      str_free(&col->column_name);
-      if (col->value.kind == QK_STR) {
-        str_free(&col->value.as.s);
-      }
+  arena_free(&res->arena);
+
+  memset(res, 0, sizeof(*res));
+}
+
+static void qk_map_value(QkResultColumn *col, const QkStructMapping *mapping,
+                         const QkStructField *field, void *struct_ptr) {
+  void *field_ptr = (char *)struct_ptr + field->offset;
+  switch (field->kind) {
+  case QK_BOOL:
+    // SQLite has no boolean type, results come back as integers
+    *(bool *)field_ptr = col->value.kind == QK_BOOL ? col->value.as.b
+                                                    : col->value.as.i != 0;
+    break;
+  case QK_INT:
+    *(int *)field_ptr = (int)col->value.as.i;
+    break;
+  case QK_DOUBLE:
+    *(double *)field_ptr = col->value.as.d;
+    break;
+  case QK_STR: {
+    switch (mapping->string_mapping) {
+    case QK_STR_TO_STR:
+      // copy out, the result may live in an arena
+      *(Str *)field_ptr = str_clone_unique(&col->value.as.s);
+      break;
+    case QK_STR_TO_SV:
+      *(StringView *)field_ptr = sv_from_str(col->value.as.s);
+      break;
+    case QK_STR_TO_SB:
+      *(StringBuilder *)field_ptr = sb_clone(&col->value.as.s.h->b);
+      break;
+    case QK_STR_TO_CSTR: {
+      size_t str_len = col->value.as.s.h->b.count;
+      char *cstr = CG_MALLOC(CG_ALLOCATOR_INSTANCE, str_len);
+      memcpy(cstr, col->value.as.s.h->b.items, str_len);
+      *(char **)field_ptr = cstr;
+    } break;
     }
-    da_free(res->rows.items[i].columns);
+  } break;
+  case QK_BLOB:
+    if (qk_param_has_str(col->value))
+      *(Str *)field_ptr = str_clone_unique(&col->value.as.s);
+    break;
+  case QK_PARAM_NONE:
+  case QK_PARAM_NULL:
+  case QK_ZEROBLOB:
+    break;
   }
-  da_free(res->rows);
+}
 
-  memset(res, 0, sizeof(*res));
+static uint64_t qk_hash_icase(const char *s, size_t len, uint64_t h) {
+  for (size_t i = 0; i < len; i += 1) {
+    unsigned char c = (unsigned char)s[i];
+    if (c >= 'A' && c <= 'Z')
+      c += 'a' - 'A';
+    h ^= c;
+    h *= 0x100000001b3ULL;
+  }
+  return h;
+}
+
+// Returns index of the field mapped to the column name or -1
+static int qk_mapping_lookup(const QkStructMapping *m, StringView name,
+                             uint64_t hash) {
+  const QkMappingIndex *index = m->index;
+  size_t lo = 0, hi = index->count;
+  while (lo < hi) {
+    size_t mid = lo + (hi - lo) / 2;
+    if (index->by_hash[mid].hash < hash)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+
+  for (size_t i = lo; i < index->count && index->by_hash[i].hash == hash;
+       i += 1) {
+    size_t f = index->by_hash[i].field;
+    if (sv_equals_icase(&m->fields.items[f].column_name, &name))
+      return (int)f;
+  }
+  return -1;
+}
+
+static void qk_mapping_index_free(QkMappingIndex *index) {
+  if (NULL == index)
+    return;
+
+  CgAllocator a = index->allocator;
+  for (size_t i = 0; i < QK_MAPPING_SCHEMA_CACHE; i += 1) {
+    a.free(a.allocator, index->plans[i].field_for_col);
+  }
+  a.free(a.allocator, index->by_hash);
+  a.free(a.allocator, index);
+}
+
+static int qk_field_hash_cmp(const void *lhs, const void *rhs) {
+  uint64_t a = ((const QkFieldHash *)lhs)->hash;
+  uint64_t b = ((const QkFieldHash *)rhs)->hash;
+  return (a > b) - (a < b);
+}
+
+void qk_struct_mapping_compile(QkStructMapping *m) {
+  qk_mapping_index_free(m->index);
+
+  QkMappingIndex *index =
+      CG_CALLOC(CG_ALLOCATOR_INSTANCE, 1, sizeof(QkMappingIndex));
+  index->allocator = CG_ALLOCATOR_CURRENT;
+  index->count = m->fields.count;
+  index->by_hash = CG_MALLOC(CG_ALLOCATOR_INSTANCE,
+                             (index->count + 1) * sizeof(QkFieldHash));
+  for (size_t i = 0; i < index->count; i += 1) {
+    StringView name = m->fields.items[i].column_name;
+    index->by_hash[i] = (QkFieldHash){
+        .hash = qk_hash_icase(name.begin, name.length, QK_HASH_SEED),
+        .field = i,
+    };
+  }
+  qsort(index->by_hash, index->count, sizeof(QkFieldHash), qk_field_hash_cmp);
+
+  m->index = index;
+}
+
+// The hash only narrows the search, a plan is used when the names match
+static bool qk_schema_plan_matches(const QkSchemaPlan *plan, uint64_t schema,
+                                   const QkResultRow *row,
+                                   size_t names_len) {
+  if (NULL == plan->field_for_col || plan->schema != schema ||
+      plan->col_count != row->columns.count || plan->names_len != names_len)
+    return false;
+
+  const char *names = plan->names;
+  for (size_t j = 0; j < row->columns.count; j += 1) {
+    StringView name = sv_from_str(row->columns.items[j].column_name);
+    if (0 != memcmp(names, name.begin, name.length) ||
+        '\0' != names[name.length])
+      return false;
+    names += name.length + 1;
+  }
+  return true;
+}
+
+// Returns the cached column -> field plan for the columns of row
+static const int *qk_mapping_plan(const QkStructMapping *m,
+                                  const QkResultRow *row) {
+  QkMappingIndex *index = m->index;
+  size_t col_count = row->columns.count;
+
+  uint64_t schema = QK_HASH_SEED;
+  size_t names_len = 0;
+  for (size_t j = 0; j < col_count; j += 1) {
+    StringView name = sv_from_str(row->columns.items[j].column_name);
+    schema = qk_hash_icase(name.begin, name.length, schema);
+    schema = qk_hash_bytes("", 1, schema); // separator
+    names_len += name.length + 1;
+  }
+
+  for (size_t i = 0; i < QK_MAPPING_SCHEMA_CACHE; i += 1) {
+    QkSchemaPlan *plan = &index->plans[i];
+    if (qk_schema_plan_matches(plan, schema, row, names_len))
+      return plan->field_for_col;
+  }
+
+  QkSchemaPlan *plan = &index->plans[index->next_plan];
+  index->next_plan = (index->next_plan + 1) % QK_MAPPING_SCHEMA_CACHE;
+
+  // field_for_col and the names share one block
+  CgAllocator a = index->allocator;
+  a.free(a.allocator, plan->field_for_col);
+  size_t ints_size = (col_count + 1) * sizeof(int);
+  plan->field_for_col = a.malloc(a.allocator, ints_size + names_len);
+  plan->schema = schema;
+  plan->col_count = col_count;
+  plan->names_len = names_len;
+
+  char *names = (char *)plan->field_for_col + ints_size;
+  plan->names = names;
+  for (size_t j = 0; j < col_count; j += 1) {
+    StringView name = sv_from_str(row->columns.items[j].column_name);
+    memcpy(names, name.begin, name.length);
+    names[name.length] = '\0';
+    names += name.length + 1;
+  }
+
+  for (size_t j = 0; j < col_count; j += 1) {
+    StringView name = sv_from_str(row->columns.items[j].column_name);
+    plan->field_for_col[j] = qk_mapping_lookup(
+        m, name, qk_hash_icase(name.begin, name.length, QK_HASH_SEED));
+  }
+
+  return plan->field_for_col;
 }
 
 void qk_map_row_to_struct(QkResultRow *row, const QkStructMapping *mapping,
                           void *struct_ptr) {
+  if (NULL != mapping->index) {
+    const int *field_for_col = qk_mapping_plan(mapping, row);
+    for (size_t j = 0; j < row->columns.count; j += 1) {
+      QkResultColumn *col = &row->columns.items[j];
+      if (field_for_col[j] < 0 || col->value.kind == QK_PARAM_NULL ||
+          col->value.kind == QK_PARAM_NONE)
+        continue;
+      qk_map_value(col, mapping, &mapping->fields.items[field_for_col[j]],
+                   struct_ptr);
+    }
+    return;
+  }
+
   for (size_t i = 0; i < mapping->fields.count; i += 1) {
     QkStructField *field = &mapping->fields.items[i];
     for (size_t j = 0; j < row->columns.count; j += 1) {
@@ -643,40 +3669,7 @@ void qk_map_row_to_struct(QkResultRow *row, const QkStructMapping *mapping,
         continue;
       if (sv_equals_icase(&sv_from_str(col->column_name),
                           &field->column_name)) {
-        void *field_ptr = (char *)struct_ptr + field->offset;
-        switch (field->kind) {
-        case QK_BOOL:
-          *(bool *)field_ptr = col->value.as.b;
-          break;
-        case QK_INT:
-          *(int *)field_ptr = col->value.as.i;
-          break;
-        case QK_DOUBLE:
-          *(double *)field_ptr = col->value.as.d;
-          break;
-        case QK_STR: {
-          switch (mapping->string_mapping) {
-          case QK_STR_TO_STR:
-            *(Str *)field_ptr = str_clone(&col->value.as.s);
-            break;
-          case QK_STR_TO_SV:
-            *(StringView *)field_ptr = sv_from_str(col->value.as.s);
-            break;
-          case QK_STR_TO_SB:
-            *(StringBuilder *)field_ptr = sb_clone(&col->value.as.s.h->b);
-            break;
-          case QK_STR_TO_CSTR: {
-            size_t str_len = col->value.as.s.h->b.count;
-            char *cstr = CG_MALLOC(CG_ALLOCATOR_INSTANCE, str_len);
-            memcpy(cstr, col->value.as.s.h->b.items, str_len);
-            *(char **)field_ptr = cstr;
-          } break;
-          }
-        } break;
-        case QK_PARAM_NONE:
-        case QK_PARAM_NULL:
-          break;
-        }
+        qk_map_value(col, mapping, field, struct_ptr);
       }
     }
   }
@@ -727,8 +3720,12 @@ void qk_map_struct_to_cols_and_values(const void *struct_ptr,
       }
       }
       break;
+    case QK_BLOB:
+      param = qk_blob(*(Str *)field_ptr);
+      break;
     case QK_PARAM_NONE:
     case QK_PARAM_NULL:
+    case QK_ZEROBLOB:
       param.kind = QK_PARAM_NONE;
       break;
     }
@@ -737,7 +3734,196 @@ void qk_map_struct_to_cols_and_values(const void *struct_ptr,
   }
 }
 
+// Copies len bytes of text into a NUL terminated buffer from the current
+// allocator
+static char *qk_cstr_dup(const char *text, size_t len) {
+  char *cstr = CG_MALLOC(CG_ALLOCATOR_INSTANCE, len + 1);
+  if (len > 0)
+    memcpy(cstr, text, len);
+  cstr[len] = '\0';
+  return cstr;
+}
+
+static void qk_fetch_field(sqlite3_stmt *stmt, int i,
+                           const QkStructMapping *mapping,
+                           const QkStructField *field, void *struct_ptr) {
+  void *field_ptr = (char *)struct_ptr + field->offset;
+
+  switch (field->kind) {
+  case QK_BOOL:
+    *(bool *)field_ptr = sqlite3_column_int(stmt, i) != 0;
+    break;
+  case QK_INT:
+    *(int *)field_ptr = sqlite3_column_int(stmt, i);
+    break;
+  case QK_DOUBLE:
+    *(double *)field_ptr = sqlite3_column_double(stmt, i);
+    break;
+  case QK_STR: {
+    const char *text = (const char *)sqlite3_column_text(stmt, i);
+    size_t len = (size_t)sqlite3_column_bytes(stmt, i);
+    switch (mapping->string_mapping) {
+    case QK_STR_TO_STR:
+      *(Str *)field_ptr =
+          str_from_sv((StringView){.begin = text, .length = len});
+      break;
+    case QK_STR_TO_SV:
+      *(StringView *)field_ptr =
+          (StringView){.begin = qk_cstr_dup(text, len), .length = len};
+      break;
+    case QK_STR_TO_SB: {
+      StringBuilder sb = sb_create(len);
+      if (len > 0)
+        memcpy(sb.items, text, len);
+      sb.count = len;
+      *(StringBuilder *)field_ptr = sb;
+    } break;
+    case QK_STR_TO_CSTR:
+      *(char **)field_ptr = qk_cstr_dup(text, len);
+      break;
+    }
+  } break;
+  case QK_BLOB: {
+    const void *blob = sqlite3_column_blob(stmt, i);
+    size_t len = (size_t)sqlite3_column_bytes(stmt, i);
+    *(Str *)field_ptr = str_from_sv((StringView){.begin = blob, .length = len});
+  } break;
+  case QK_PARAM_NONE:
+  case QK_PARAM_NULL:
+  case QK_ZEROBLOB:
+    break;
+  }
+}
+
+static bool qk_fetch_step_sqlite(sqlite3 *db, sqlite3_stmt *stmt,
+                                 const QkStructMapping *mapping, void **items,
+                                 size_t *count, size_t *capacity,
+                                 size_t item_size, QkTraceEvent *ev) {
+  // resolve the column of each field once for the whole statement
+  size_t nfields = mapping->fields.count;
+  int *plan = CG_MALLOC(CG_ALLOCATOR_INSTANCE, (nfields + 1) * sizeof(int));
+  for (size_t f = 0; f < nfields; f += 1) {
+    plan[f] = -1;
+  }
+
+  int col_count = sqlite3_column_count(stmt);
+  for (int i = 0; i < col_count; i += 1) {
+    StringView name = sv_from_cstr(sqlite3_column_name(stmt, i));
+    if (NULL != mapping->index) {
+      int f = qk_mapping_lookup(
+          mapping, name, qk_hash_icase(name.begin, name.length, QK_HASH_SEED));
+      if (f >= 0 && plan[f] < 0)
+        plan[f] = i;
+      continue;
+    }
+
+    for (size_t f = 0; f < nfields; f += 1) {
+      if (plan[f] < 0 &&
+          sv_equals_icase(&name, &mapping->fields.items[f].column_name))
+        plan[f] = i;
+    }
+  }
+
+  bool ok = true;
+  while (true) {
+    int rc = sqlite3_step(stmt);
+    if (rc == SQLITE_DONE)
+      break;
+    else if (rc != SQLITE_ROW) {
+      printf("[Error] sqlite3 step failed: %s\n", sqlite3_errmsg(db));
+      ok = false;
+      break;
+    }
+
+    if (*count >= *capacity) {
+      size_t new_capacity =
+          *capacity ? *capacity * DA_GROW_FACTOR : DA_INIT_CAPACITY;
+      *items = CG_REALLOC(CG_ALLOCATOR_INSTANCE, *items, *capacity * item_size,
+                          new_capacity * item_size);
+      assert(NULL != *items && "Failed to allocate memory for fetched rows");
+      *capacity = new_capacity;
+    }
+
+    void *struct_ptr = (char *)*items + *count * item_size;
+    memset(struct_ptr, 0, item_size);
+    ev->bytes_materialized += item_size;
+    for (size_t f = 0; f < nfields; f += 1) {
+      int i = plan[f];
+      if (i < 0 || sqlite3_column_type(stmt, i) == SQLITE_NULL)
+        continue;
+      qk_fetch_field(stmt, i, mapping, &mapping->fields.items[f], struct_ptr);
+      if (mapping->fields.items[f].kind == QK_STR ||
+          mapping->fields.items[f].kind == QK_BLOB)
+        ev->bytes_materialized += (size_t)sqlite3_column_bytes(stmt, i);
+    }
+    *count += 1;
+    ev->rows_returned += 1;
+  }
+
+  CG_FREE(CG_ALLOCATOR_INSTANCE, plan);
+  return ok;
+}
+
+bool qk_sql_fetch_sqlite(QkSqlQuery *q, sqlite3 *db,
+                         const QkStructMapping *mapping, void **items,
+                         size_t *count, size_t *capacity, size_t item_size) {
+  if (!qk_sql_build(q, QK_SQL_DIALECT_SQLITE))
+    return false;
+
+  const char *sql = sb_get_cstr(&q->b);
+
+  QkTrace t;
+  qk_trace_begin(&t, q->op);
+
+  sqlite3_stmt *stmt = NULL;
+  if (sqlite3_prepare_v2(db, sql, -1, &stmt, NULL) != SQLITE_OK) {
+    fprintf(stderr, "SQL prepare error: %s\n", sqlite3_errmsg(db));
+    qk_trace_end(&t, db, sql, false);
+    return false;
+  }
+  qk_trace_lap(&t, &t.ev.prepare_ns);
+
+  qk_sql_bind_sqlite(q, stmt);
+  qk_trace_lap(&t, &t.ev.bind_ns);
+
+  bool ok = qk_fetch_step_sqlite(db, stmt, mapping, items, count, capacity,
+                                 item_size, &t.ev);
+  qk_trace_lap(&t, &t.ev.step_ns);
+  qk_trace_end(&t, db, sql, ok);
+
+  sqlite3_finalize(stmt);
+  return ok;
+}
+
+bool qk_conn_fetch(QkConn *c, QkSqlQuery *q, const QkStructMapping *mapping,
+                   void **items, size_t *count, size_t *capacity,
+                   size_t item_size) {
+  if (!qk_sql_build(q, QK_SQL_DIALECT_SQLITE))
+    return false;
+
+  const char *sql = sb_get_cstr(&q->b);
+
+  QkTrace t;
+  qk_trace_begin(&t, q->op);
+
+  sqlite3_stmt *stmt = qk_conn_prepare_traced(c, sql, &t);
+  if (NULL == stmt)
+    return false;
+
+  qk_sql_bind_sqlite(q, stmt);
+  qk_trace_lap(&t, &t.ev.bind_ns);
+
+  bool ok = qk_fetch_step_sqlite(c->db, stmt, mapping, items, count, capacity,
+                                 item_size, &t.ev);
+  qk_trace_lap(&t, &t.ev.step_ns);
+  qk_trace_end(&t, c->db, sql, ok);
+
+  qk_conn_release(c, stmt);
+  return ok;
+}
+
 void qk_struct_mapping_free(QkStructMapping *m) {
+  qk_mapping_index_free(m->index);
   da_free(m->fields);
   memset(m, 0, sizeof(*m));
 }